@@ -0,0 +1,280 @@
+#include "Accumulator.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+#include <stdexcept>
+
+#ifdef _WIN32
+#define NOMINMAX
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+namespace
+{
+constexpr char     MAGIC[8] = {'R', 'T', 'A', 'C', 'C', 'U', 'M', '\0'};
+constexpr uint32_t VERSION = 3;
+};        // namespace
+
+Accumulator::Accumulator(const std::string& filepath)
+    : filepath(filepath)
+{
+	try {
+		map(0, 0, 0, false);
+	} catch (...) {
+		unmap();
+		throw;
+	}
+}
+
+Accumulator::Accumulator(const std::string& filepath, int width, int height, uint32_t seed)
+    : filepath(filepath)
+{
+	// a file this call created is removed again when it cannot be set up, so no half written checkpoint is left behind
+	bool create = !std::filesystem::exists(filepath);
+	try {
+		map(width, height, seed, create);
+		if (this->width() != width || this->height() != height)
+			throw std::runtime_error("Checkpoint has a different resolution: " + filepath);
+	} catch (...) {
+		bool created = create && file != -1;
+		unmap();
+		if (created) {
+			std::error_code error;
+			std::filesystem::remove(filepath, error);
+		}
+		throw;
+	}
+}
+
+Accumulator::~Accumulator()
+{
+	unmap();
+}
+
+void Accumulator::unmap()
+{
+#ifdef _WIN32
+	if (data)
+		UnmapViewOfFile(data);
+	if (mapping)
+		CloseHandle(mapping);
+	if (file != -1)
+		CloseHandle(reinterpret_cast<HANDLE>(file));
+#else
+	if (data)
+		munmap(data, size);
+	if (file != -1)
+		close(static_cast<int>(file));
+#endif
+	data = nullptr;
+	mapping = nullptr;
+	file = -1;
+}
+
+void Accumulator::add(const std::vector<vec3f_t>& framebuffer, const std::vector<int>& sample_counts, int next_sample)
+{
+	// the framebuffer holds means, weighted back into sums by how many samples each pixel took
+	Pixel* pixel = staged();
+	for (size_t p = 0; p < framebuffer.size(); p++) {
+		for (int c = 0; c < 3; c++)
+			pixel[p].sum[c] += framebuffer[p][c] * sample_counts[p];
+		pixel[p].count += sample_counts[p];
+	}
+	pending_sample = std::max(pending_sample, next_sample);
+}
+
+void Accumulator::merge(const Accumulator& other)
+{
+	// runs with the same seed took the same samples, adding them up would only count each twice, so no seed already summed
+	// in is taken again; an empty file takes the seeds of the first one merged into it
+	if (other.width() != width() || other.height() != height())
+		throw std::runtime_error("Checkpoint has a different resolution: " + other.filepath);
+
+	bool                  empty = nextSample() == 0;
+	std::vector<uint32_t> merged = empty ? std::vector<uint32_t>{} : seeds();
+	for (uint32_t other_seed : other.seeds()) {
+		if (std::find(merged.begin(), merged.end(), other_seed) != merged.end())
+			throw std::runtime_error("Checkpoint has the same seed: " + other.filepath);
+		merged.push_back(other_seed);
+	}
+	if (merged.size() > MAX_SEEDS)
+		throw std::runtime_error("Checkpoint has too many seeds merged: " + other.filepath);
+	if (empty)
+		header()->seed = other.seed();
+
+	Pixel* pixel = staged();
+	Seeds* seed_set = seedSet(generation() + 1);
+	seed_set->count = static_cast<uint32_t>(merged.size());
+	std::copy(merged.begin(), merged.end(), seed_set->values);
+
+	const Pixel* other_pixel = other.current();
+	for (int p = 0; p < width() * height(); p++) {
+		for (int c = 0; c < 3; c++)
+			pixel[p].sum[c] += other_pixel[p].sum[c];
+		pixel[p].count += other_pixel[p].count;
+	}
+	pending_sample = std::max(pending_sample, other.nextSample());
+}
+
+void Accumulator::checkpoint()
+{
+	if (!pending)
+		return;
+
+	// the new sums reach the file before the header that points at them
+	flush();
+	header()->commit = static_cast<uint64_t>(generation() + 1) << 32 | static_cast<uint32_t>(pending_sample);
+	pending = false;
+	flush();
+}
+
+void Accumulator::resolve(std::vector<vec3f_t>& framebuffer, std::vector<int>& sample_counts) const
+{
+	const Pixel* pixel = current();
+	framebuffer.resize(width() * height());
+	sample_counts.resize(width() * height());
+	for (int p = 0; p < width() * height(); p++) {
+		vec3f_t sum(pixel[p].sum[0], pixel[p].sum[1], pixel[p].sum[2]);
+		framebuffer[p] = sum / std::max<uint32_t>(pixel[p].count, 1);
+		sample_counts[p] = static_cast<int>(pixel[p].count);
+	}
+}
+
+int Accumulator::width() const
+{
+	return header()->width;
+}
+
+int Accumulator::height() const
+{
+	return header()->height;
+}
+
+uint32_t Accumulator::seed() const
+{
+	return header()->seed;
+}
+
+std::vector<uint32_t> Accumulator::seeds() const
+{
+	const Seeds* seed_set = seedSet(pending ? generation() + 1 : generation());
+	return std::vector<uint32_t>(seed_set->values, seed_set->values + std::min<uint32_t>(seed_set->count, MAX_SEEDS));
+}
+
+int Accumulator::nextSample() const
+{
+	return pending ? pending_sample : static_cast<int>(static_cast<uint32_t>(header()->commit));
+}
+
+void Accumulator::flush()
+{
+#ifdef _WIN32
+	bool flushed = FlushViewOfFile(data, size) && FlushFileBuffers(reinterpret_cast<HANDLE>(file));
+#else
+	bool flushed = msync(data, size, MS_SYNC) == 0;
+#endif
+	if (!flushed)
+		throw std::runtime_error("Failed to write checkpoint: " + filepath);
+}
+
+void Accumulator::map(int width, int height, uint32_t seed, bool create)
+{
+	// a new file is sized for both copies of its pixels up front, an existing one is mapped whole and its header checked
+	size_t new_size = sizeof(Header) + 2 * (sizeof(Seeds) + sizeof(Pixel) * static_cast<size_t>(width) * height);
+#ifdef _WIN32
+	HANDLE handle = CreateFileA(filepath.c_str(), GENERIC_READ | GENERIC_WRITE, 0, nullptr, create ? CREATE_NEW : OPEN_EXISTING,
+	                            FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (handle == INVALID_HANDLE_VALUE)
+		throw std::runtime_error("Failed to open checkpoint: " + filepath);
+	file = reinterpret_cast<intptr_t>(handle);
+
+	LARGE_INTEGER file_size;
+	if (!create && GetFileSizeEx(handle, &file_size))
+		new_size = static_cast<size_t>(file_size.QuadPart);
+	size = new_size;
+	mapping = CreateFileMappingA(handle, nullptr, PAGE_READWRITE, static_cast<DWORD>(static_cast<uint64_t>(size) >> 32),
+	                             static_cast<DWORD>(size), nullptr);
+	if (mapping)
+		data = static_cast<char*>(MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, size));
+#else
+	int descriptor = ::open(filepath.c_str(), create ? O_RDWR | O_CREAT | O_EXCL : O_RDWR, 0644);
+	if (descriptor < 0)
+		throw std::runtime_error("Failed to open checkpoint: " + filepath);
+	file = descriptor;
+
+	if (create && ftruncate(descriptor, static_cast<off_t>(new_size)) != 0)
+		throw std::runtime_error("Failed to size checkpoint: " + filepath);
+	size = create ? new_size : static_cast<size_t>(lseek(descriptor, 0, SEEK_END));
+	void* address = size >= sizeof(Header) ? mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, descriptor, 0) : MAP_FAILED;
+	if (address != MAP_FAILED)
+		data = static_cast<char*>(address);
+#endif
+	if (!data)
+		throw std::runtime_error("Failed to map checkpoint: " + filepath);
+
+	// a fresh file reads as zeros, so only the header needs writing
+	if (create) {
+		std::memcpy(header()->magic, MAGIC, sizeof(MAGIC));
+		header()->version = VERSION;
+		header()->width = width;
+		header()->height = height;
+		header()->seed = seed;
+		header()->commit = 0;
+		seedSet(0)->count = 1;
+		seedSet(0)->values[0] = seed;
+	}
+
+	const Header* stored = header();
+	if (size < sizeof(Header) || std::memcmp(stored->magic, MAGIC, sizeof(MAGIC)) != 0 || stored->version != VERSION ||
+	    stored->width <= 0 || stored->height <= 0 ||
+	    size < sizeof(Header) + 2 * copySize())
+		throw std::runtime_error("Not a checkpoint: " + filepath);
+}
+
+Accumulator::Header* Accumulator::header() const
+{
+	return reinterpret_cast<Header*>(data);
+}
+
+uint32_t Accumulator::generation() const
+{
+	return static_cast<uint32_t>(header()->commit >> 32);
+}
+
+size_t Accumulator::copySize() const
+{
+	return sizeof(Seeds) + sizeof(Pixel) * static_cast<size_t>(width()) * height();
+}
+
+Accumulator::Seeds* Accumulator::seedSet(uint32_t generation) const
+{
+	// even generations commit the first copy, odd ones the second, each starts with its seeds
+	return reinterpret_cast<Seeds*>(data + sizeof(Header) + (generation & 1) * copySize());
+}
+
+Accumulator::Pixel* Accumulator::pixels(uint32_t generation) const
+{
+	return reinterpret_cast<Pixel*>(reinterpret_cast<char*>(seedSet(generation)) + sizeof(Seeds));
+}
+
+const Accumulator::Pixel* Accumulator::current() const
+{
+	return pixels(pending ? generation() + 1 : generation());
+}
+
+Accumulator::Pixel* Accumulator::staged()
+{
+	if (!pending) {
+		std::memcpy(seedSet(generation() + 1), seedSet(generation()), copySize());
+		pending_sample = nextSample();
+		pending = true;
+	}
+
+	return pixels(generation() + 1);
+}
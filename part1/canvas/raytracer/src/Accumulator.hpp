@@ -0,0 +1,74 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "global.hpp"
+
+// per pixel sums of radiance and sample counts in a memory mapped file, so a render can stop after any checkpoint and be
+// picked up from it later, and partial renders of one image from different machines or seeds add up to the whole
+//
+// the file keeps two copies of the sums, each with the seeds of every render summed into it: changes go to the one not
+// committed and a checkpoint flushes it before the header that commits it, so a render cut off at any point resumes from
+// its last whole checkpoint
+class Accumulator {
+public:
+	explicit Accumulator(const std::string& filepath);                                     // an existing checkpoint
+	Accumulator(const std::string& filepath, int width, int height, uint32_t seed);        // or a new one where there is none
+	~Accumulator();
+
+	Accumulator(const Accumulator&) = delete;
+	Accumulator& operator=(const Accumulator&) = delete;
+
+	void add(const std::vector<vec3f_t>& framebuffer, const std::vector<int>& sample_counts, int next_sample);
+	void merge(const Accumulator& other);
+	void checkpoint();        // blocks until the file holds everything added so far
+	void resolve(std::vector<vec3f_t>& framebuffer, std::vector<int>& sample_counts) const;
+
+	auto width() const -> int;
+	auto height() const -> int;
+	auto seed() const -> uint32_t;
+	auto seeds() const -> std::vector<uint32_t>;        // every seed summed in, merging any of them again is refused
+	auto nextSample() const -> int;        // sample index a resumed render starts at
+
+private:
+	struct Header {
+		char     magic[8];
+		uint32_t version;
+		int32_t  width;
+		int32_t  height;
+		uint32_t seed;
+		uint64_t commit;        // generation in the high half and its next sample in the low, one store so never torn
+	};
+
+	static constexpr int MAX_SEEDS = 255;
+
+	struct Seeds {
+		uint32_t count;
+		uint32_t values[MAX_SEEDS];
+	};
+
+	struct Pixel {
+		float    sum[3];
+		uint32_t count;
+	};
+
+	std::string filepath;
+	intptr_t    file{-1};                // descriptor, or handle on windows
+	void*       mapping{};               // mapping object on windows
+	char*       data{};
+	size_t      size{};
+	bool        pending{};               // the uncommitted copy holds changes
+	int         pending_sample{};        // next sample of the uncommitted copy
+
+	void map(int width, int height, uint32_t seed, bool create);
+	void unmap();
+	void flush();
+	auto header() const -> Header*;
+	auto generation() const -> uint32_t;
+	auto copySize() const -> size_t;
+	auto seedSet(uint32_t generation) const -> Seeds*;
+	auto pixels(uint32_t generation) const -> Pixel*;
+	auto current() const -> const Pixel*;        // the latest sums, committed or not
+	auto staged() -> Pixel*;                     // the uncommitted copy, started from the committed one
+};
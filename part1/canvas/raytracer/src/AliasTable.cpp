@@ -0,0 +1,73 @@
+#include "AliasTable.hpp"
+
+#include <algorithm>
+#include <numeric>
+
+AliasTable::AliasTable(const std::vector<float>& weights)
+{
+	double total = std::accumulate(weights.begin(), weights.end(), 0.0);
+	if (weights.empty() || !(total > 0))
+		return;
+
+	int n = static_cast<int>(weights.size());
+	bins.resize(n);
+
+	// scaled so the average bin holds exactly 1, bins below take the rest from one above
+	std::vector<double> scaled(n);
+	std::vector<int>    small, large;
+	for (int i = 0; i < n; i++) {
+		bins[i].pmf = static_cast<float>(weights[i] / total);
+		scaled[i] = weights[i] / total * n;
+		(scaled[i] < 1 ? small : large).push_back(i);
+	}
+
+	while (!small.empty() && !large.empty()) {
+		int s = small.back();
+		int l = large.back();
+		small.pop_back();
+		bins[s].probability = static_cast<float>(scaled[s]);
+		bins[s].alias = l;
+
+		scaled[l] -= 1 - scaled[s];
+		if (scaled[l] < 1) {
+			large.pop_back();
+			small.push_back(l);
+		}
+	}
+
+	// leftovers are 1 up to rounding
+	for (auto* rest : {&small, &large}) {
+		for (int i : *rest) {
+			bins[i].probability = 1;
+			bins[i].alias = i;
+		}
+	}
+}
+
+int AliasTable::sample(float u, float& pmf) const
+{
+	// the integer part picks the bin, the fraction decides between the bin and its alias
+	float scaled = u * bins.size();
+	int   index = std::min(static_cast<int>(scaled), static_cast<int>(bins.size()) - 1);
+	float remainder = scaled - index;
+	if (remainder >= bins[index].probability)
+		index = bins[index].alias;
+
+	pmf = bins[index].pmf;
+	return index;
+}
+
+float AliasTable::pmf(int index) const
+{
+	return bins[index].pmf;
+}
+
+int AliasTable::size() const
+{
+	return static_cast<int>(bins.size());
+}
+
+bool AliasTable::empty() const
+{
+	return bins.empty();
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+// discrete distribution over weighted items, one uniform number picks an item in constant time (Vose's alias method)
+class AliasTable {
+public:
+	AliasTable() = default;
+	explicit AliasTable(const std::vector<float>& weights);
+
+	auto sample(float u, float& pmf) const -> int;
+	auto pmf(int index) const -> float;
+	auto size() const -> int;
+	bool empty() const;
+
+private:
+	struct Bin {
+		float probability{};        // chance to keep this bin, otherwise its alias is taken
+		float pmf{};
+		int   alias{};
+	};
+
+	std::vector<Bin> bins;
+};
@@ -1,82 +1,466 @@
 #include "BVH.hpp"
+#include "Instance.hpp"
 
-BVHAccel::BVHAccel(std::vector<Primitive*> primitives,
-                   int                     max_primitives_per_leaf,
-                   BVHBuildMethod          build_method) :
-    MAX_PRIMITIVES_PER_LEAF(max_primitives_per_leaf),
-    BUILD_METHOD(build_method)
+#include <bit>
+
+namespace
+{
+// the widest lane tests the cpu runs, picked once at startup
+const BVHInstructionSet INSTRUCTION_SET = selectBVHInstructionSet();
+
+#if defined(BVH_KERNELS_AVX)
+template <typename Query>
+BVH_TARGET_AVX_FLATTEN auto withAVXKernels(Query& query)
+{
+	return query(AVXKernels{});
+}
+#endif
+
+// runs a query on the traversal instantiated for the kernel set picked at startup
+template <typename Query>
+auto withKernels(Query&& query)
+{
+#if defined(BVH_KERNELS_AVX)
+	if (INSTRUCTION_SET == BVHInstructionSet::AVX)
+		return withAVXKernels(query);
+	if (INSTRUCTION_SET == BVHInstructionSet::SSE)
+		return query(SSEKernels{});
+#endif
+
+	return query(ScalarKernels{});
+}
+
+// runs the kernel on each primitive of a leaf cast to its concrete type, the classes are final so no call goes through the vtable
+template <typename Kernel>
+void forEachInLeaf(PrimitiveType type, Primitive* const* primitives, int offset, int count, Kernel&& kernel)
+{
+	switch (type) {
+	case PrimitiveType::TRIANGLE:
+		// triangle leaves are tested on the packed blocks instead
+		break;
+	case PrimitiveType::SPHERE:
+		for (int i = offset; i < offset + count; i++)
+			kernel(static_cast<const Sphere*>(primitives[i]), i);
+		break;
+	case PrimitiveType::MODEL:
+		for (int i = offset; i < offset + count; i++)
+			kernel(static_cast<const Model*>(primitives[i]), i);
+		break;
+	case PrimitiveType::INSTANCE:
+		for (int i = offset; i < offset + count; i++)
+			kernel(static_cast<const Instance*>(primitives[i]), i);
+		break;
+	}
+}
+};        // namespace
+
+BVHAccel::BVHAccel(const std::vector<Primitive*>& primitives,
+                   int                            max_primitives_per_leaf,
+                   BVHBuildMethod                 build_method,
+                   int                            num_threads,
+                   BVHLayout                      layout) :
+    MAX_PRIMITIVES_PER_LEAF(std::clamp(max_primitives_per_leaf, 1, 255)),
+    BUILD_METHOD(build_method),
+    LAYOUT(layout)
 {
+	constexpr int MIN_PARALLEL_PRIMITIVES = 4096;
+
 	if (primitives.empty())
 		return;
 
-	root = build(primitives);
+	const int n = primitives.size();
+
+	std::vector<BVHPrimitiveInfo> infos(n);
+	auto init_infos = [&](int start, int end) {
+		for (int i = start; i < end; i++) {
+			infos[i].index = i;
+			infos[i].type = primitives[i]->type();
+			infos[i].bound = primitives[i]->bound();
+			infos[i].centroid = infos[i].bound.centroid();
+		}
+	};
+
+	// large inputs split their top levels with parallel binning, then build the subtrees below as independent tasks
+	BVHNode* root{};
+	if (n >= MIN_PARALLEL_PRIMITIVES && num_threads != 1) {
+		ThreadPool pool(num_threads);
+		pool.parallelFor(0, n, [&](int, int start, int end) { init_infos(start, end); });
+
+		std::vector<std::function<void()>> subtrees;
+		int task_size = std::max(MIN_PARALLEL_PRIMITIVES, n / (8 * pool.size()));
+		root = buildParallel(infos, 0, n, 0, task_size, pool, subtrees);
+		for (auto& subtree : subtrees)
+			pool.submit(std::move(subtree));
+		pool.wait();
+	} else {
+		init_infos(0, n);
+		root = build(infos, 0, n, 0);
+	}
+
+	flatten(root);
+	destroy(root);
+
+	if (LAYOUT != BVHLayout::BINARY) {
+		if (LAYOUT == BVHLayout::WIDE4)
+			collapse<4>(0);
+		else
+			collapse<8>(0);
+		nodes.clear();
+		nodes.shrink_to_fit();
+	}
+
+	// leaves index contiguous ranges of the primitives in build order
+	ordered_primitives.reserve(n);
+	primitive_types.reserve(n);
+	for (const auto& info : infos) {
+		ordered_primitives.push_back(primitives[info.index]);
+		primitive_types.push_back(info.type);
+	}
+
+	// triangle leaves are tested on a packed copy, lanes of other primitive types stay degenerate and never hit
+	if (std::find(primitive_types.begin(), primitive_types.end(), PrimitiveType::TRIANGLE) != primitive_types.end()) {
+		triangle_blocks.resize((n + BVH_WIDTH - 1) / BVH_WIDTH);
+		int blocks = static_cast<int>(triangle_blocks.size());
+		for (int i = 0; i < blocks * BVH_WIDTH; i++) {
+			auto&       block = triangle_blocks[i / BVH_WIDTH];
+			const auto* triangle = i < n && primitive_types[i] == PrimitiveType::TRIANGLE ? static_cast<Triangle*>(ordered_primitives[i]) : nullptr;
+			for (int axis = 0; axis < 3; axis++) {
+				block.v0[axis][i % BVH_WIDTH] = triangle ? triangle->v0[axis] : 0.f;
+				block.e1[axis][i % BVH_WIDTH] = triangle ? triangle->v1[axis] - triangle->v0[axis] : 0.f;
+				block.e2[axis][i % BVH_WIDTH] = triangle ? triangle->v2[axis] - triangle->v0[axis] : 0.f;
+			}
+		}
+	}
+
+	area_cdf.reserve(n);
+	float total_area = 0.f;
+	for (const auto* p : ordered_primitives) {
+		total_area += p->area();
+		area_cdf.push_back(total_area);
+	}
 }
 
-BVHAccel::~BVHAccel()
+BVHNode* BVHAccel::build(std::vector<BVHPrimitiveInfo>& infos, int start, int end, int depth)
 {
-	destroy(root);
+	auto* node = new BVHNode();
+
+	Bound total_bound{};
+	Bound centroid_bound{};
+	for (int i = start; i < end; i++) {
+		total_bound = Bound::merge(total_bound, infos[i].bound);
+		centroid_bound = Bound::merge(centroid_bound, infos[i].centroid);
+	}
+	node->bound = total_bound;
+
+	int mid{};
+	if (end - start == 1 || !split(infos, start, end, depth, total_bound, centroid_bound, node->split_axis, mid, nullptr))
+		return buildLeaf(infos, node, start, end, depth);
+
+	node->left = build(infos, start, mid, depth + 1);
+	node->right = build(infos, mid, end, depth + 1);
+
+	return node;
 }
 
-BVHNode* BVHAccel::build(std::vector<Primitive*> primitives)
+BVHNode* BVHAccel::buildParallel(std::vector<BVHPrimitiveInfo>& infos, int start, int end, int depth, int task_size,
+                                 ThreadPool& pool, std::vector<std::function<void()>>& subtrees)
 {
 	auto* node = new BVHNode();
 
+	std::vector<Bound> total_bounds(pool.size());
+	std::vector<Bound> centroid_bounds(pool.size());
+	pool.parallelFor(start, end, [&](int chunk, int chunk_start, int chunk_end) {
+		for (int i = chunk_start; i < chunk_end; i++) {
+			total_bounds[chunk] = Bound::merge(total_bounds[chunk], infos[i].bound);
+			centroid_bounds[chunk] = Bound::merge(centroid_bounds[chunk], infos[i].centroid);
+		}
+	});
+
 	Bound total_bound{};
-	for (const auto* p : primitives)
-		total_bound = Bound::merge(total_bound, p->bound());
-
-	if (primitives.size() == 1) {
-		node->bound = primitives.front()->bound();
-		node->primitive = primitives.front();
-		node->left = nullptr;
-		node->right = nullptr;
-		node->area = primitives.front()->area();
-		return node;
-	} else if (primitives.size() == 2) {
-		node->left = build({primitives[0]});
-		node->right = build({primitives[1]});
-		node->bound = Bound::merge(node->left->bound, node->right->bound);
-		node->area = node->left->area + node->right->area;
+	Bound centroid_bound{};
+	for (int chunk = 0; chunk < pool.size(); chunk++) {
+		total_bound = Bound::merge(total_bound, total_bounds[chunk]);
+		centroid_bound = Bound::merge(centroid_bound, centroid_bounds[chunk]);
+	}
+	node->bound = total_bound;
+
+	int mid{};
+	if (end - start == 1 || !split(infos, start, end, depth, total_bound, centroid_bound, node->split_axis, mid, &pool))
+		return buildLeaf(infos, node, start, end, depth);
+
+	// min/max merges and bucket counts are order independent, so the tree matches a serial build
+	std::pair<int, int> ranges[2] = {{start, mid}, {mid, end}};
+	BVHNode**           children[2] = {&node->left, &node->right};
+	for (int c = 0; c < 2; c++) {
+		auto [child_start, child_end] = ranges[c];
+		if (child_end - child_start >= task_size)
+			*children[c] = buildParallel(infos, child_start, child_end, depth + 1, task_size, pool, subtrees);
+		else
+			subtrees.push_back([this, &infos, child = children[c], child_start, child_end, depth] {
+				*child = build(infos, child_start, child_end, depth + 1);
+			});
+	}
+
+	return node;
+}
+
+BVHNode* BVHAccel::buildLeaf(std::vector<BVHPrimitiveInfo>& infos, BVHNode* node, int start, int end, int depth)
+{
+	// leaves hold a single primitive type, a mixed range is split by type instead
+	auto first_type = infos[start].type;
+	int  mid = std::stable_partition(infos.begin() + start, infos.begin() + end,
+	                                 [first_type](const auto& info) { return info.type == first_type; }) -
+	          infos.begin();
+	if (mid < end) {
+		node->left = build(infos, start, mid, depth + 1);
+		node->right = build(infos, mid, end, depth + 1);
 		return node;
+	}
+
+	node->first_offset = start;
+	node->num_primitives = end - start;
+
+	return node;
+}
+
+bool BVHAccel::split(std::vector<BVHPrimitiveInfo>& infos, int start, int end, int depth,
+                     const Bound& total_bound, const Bound& centroid_bound, int& split_axis, int& mid, ThreadPool* pool) const
+{
+	constexpr int TYPE_LEVELS = 3;        // a leaf of mixed primitive types splits off one type per level
+
+	int count = end - start;
+	mid = start + count / 2;
+
+	// the sah may peel off a few primitives at a time on skewed input, near the depth limit only halving is safe; median
+	// splits reach a leaf within bit_width(count) more levels
+	bool near_limit = depth + std::bit_width(static_cast<unsigned>(count)) + TYPE_LEVELS >= MAX_DEPTH - 1;
+	switch (near_limit ? BVHBuildMethod::NAIVE : BUILD_METHOD) {
+	case BVHBuildMethod::NAIVE:
+		if (count <= MAX_PRIMITIVES_PER_LEAF)
+			return false;
+
+		split_axis = centroid_bound.maxextent();
+		std::nth_element(infos.begin() + start, infos.begin() + mid, infos.begin() + end,
+		                 [axis = split_axis](const auto& a, const auto& b) {
+			                 return a.centroid[axis] < b.centroid[axis];
+		                 });
+		return true;
+	case BVHBuildMethod::SAH:
+		return splitSAH(infos, start, end, total_bound, centroid_bound, split_axis, mid, pool);
+	}
+
+	return false;
+}
+
+bool BVHAccel::splitSAH(std::vector<BVHPrimitiveInfo>& infos, int start, int end,
+                        const Bound& total_bound, const Bound& centroid_bound, int& split_axis, int& mid, ThreadPool* pool) const
+{
+	constexpr int   NUM_BUCKETS = 12;
+	constexpr float TRAVERSAL_COST = 1.f;
+
+	struct Bucket {
+		int   count{};
+		Bound bound{};
+	};
+	using Buckets = std::array<std::array<Bucket, NUM_BUCKETS>, 3>;
+
+	const int n = end - start;
+
+	vec3f_t extent = centroid_bound.diagonal();
+	vec3f_t scale = vec3f_t(NUM_BUCKETS, NUM_BUCKETS, NUM_BUCKETS).cwiseQuotient(extent);
+
+	auto bucket_of = [&](const BVHPrimitiveInfo& info, int axis) {
+		int b = (info.centroid[axis] - centroid_bound.pmin[axis]) * scale[axis];
+		return std::clamp(b, 0, NUM_BUCKETS - 1);
+	};
+
+	// bin every primitive on all axes with a non-degenerate centroid extent
+	auto bin = [&](int bin_start, int bin_end, Buckets& buckets) {
+		for (int i = bin_start; i < bin_end; i++) {
+			for (int axis = 0; axis < 3; axis++) {
+				if (extent[axis] <= 0.f)
+					continue;
+				auto& bucket = buckets[axis][bucket_of(infos[i], axis)];
+				bucket.count++;
+				bucket.bound = Bound::merge(bucket.bound, infos[i].bound);
+			}
+		}
+	};
+
+	Buckets buckets{};
+	if (pool) {
+		std::vector<Buckets> chunk_buckets(pool->size());
+		pool->parallelFor(start, end, [&](int chunk, int chunk_start, int chunk_end) {
+			bin(chunk_start, chunk_end, chunk_buckets[chunk]);
+		});
+		for (const auto& partial : chunk_buckets) {
+			for (int axis = 0; axis < 3; axis++) {
+				for (int b = 0; b < NUM_BUCKETS; b++) {
+					buckets[axis][b].count += partial[axis][b].count;
+					buckets[axis][b].bound = Bound::merge(buckets[axis][b].bound, partial[axis][b].bound);
+				}
+			}
+		}
 	} else {
-		Bound centroid_bound{};
-		for (auto* p : primitives)
-			centroid_bound = Bound::merge(centroid_bound, p->bound().centroid());
-
-		switch (int dim = centroid_bound.maxextent(); dim) {
-		case 0:
-			std::sort(primitives.begin(), primitives.end(), [](auto* a, auto* b) {
-				return a->bound().centroid().x() < b->bound().centroid().x();
-			});
-			break;
-		case 1:
-			std::sort(primitives.begin(), primitives.end(), [](auto* a, auto* b) {
-				return a->bound().centroid().y() < b->bound().centroid().y();
-			});
-			break;
-		case 2:
-			std::sort(primitives.begin(), primitives.end(), [](auto* a, auto* b) {
-				return a->bound().centroid().z() < b->bound().centroid().z();
-			});
-			break;
+		bin(start, end, buckets);
+	}
+
+	// evaluate the split cost after every bucket on each axis, relative to intersecting one primitive
+	double total_area = total_bound.area();
+	double inv_total_area = total_area > 0. ? 1. / total_area : 0.;
+	double best_cost = std::numeric_limits<double>::max();
+	int    best_axis = -1;
+	int    best_bucket = 0;
+
+	for (int axis = 0; axis < 3; axis++) {
+		if (extent[axis] <= 0.f)
+			continue;
+
+		const auto& axis_buckets = buckets[axis];
+
+		double right_cost[NUM_BUCKETS - 1]{};
+		int    right_count[NUM_BUCKETS - 1]{};
+		Bound  right_bound{};
+		int    count = 0;
+		for (int b = NUM_BUCKETS - 1; b > 0; b--) {
+			if (axis_buckets[b].count) {
+				right_bound = Bound::merge(right_bound, axis_buckets[b].bound);
+				count += axis_buckets[b].count;
+			}
+			right_count[b - 1] = count;
+			right_cost[b - 1] = count ? count * right_bound.area() : 0.;
+		}
+
+		Bound left_bound{};
+		count = 0;
+		for (int b = 0; b < NUM_BUCKETS - 1; b++) {
+			if (axis_buckets[b].count) {
+				left_bound = Bound::merge(left_bound, axis_buckets[b].bound);
+				count += axis_buckets[b].count;
+			}
+			if (!count || !right_count[b] || !axis_buckets[b].count)
+				continue;
+
+			double cost = TRAVERSAL_COST + (count * left_bound.area() + right_cost[b]) * inv_total_area;
+			if (cost < best_cost) {
+				best_cost = cost;
+				best_axis = axis;
+				best_bucket = b;
+			}
 		}
+	}
+
+	// all centroids coincide, so only an arbitrary halving is possible
+	if (best_axis < 0) {
+		split_axis = centroid_bound.maxextent();
+		mid = start + n / 2;
+		return n > MAX_PRIMITIVES_PER_LEAF;
+	}
 
-		auto beg = primitives.begin();
-		auto mid = primitives.begin() + primitives.size() / 2;
-		auto end = primitives.end();
-		auto left_primitives = std::vector<Primitive*>(beg, mid);
-		auto right_primitives = std::vector<Primitive*>(mid, end);
+	if (n <= MAX_PRIMITIVES_PER_LEAF && best_cost >= n)
+		return false;
 
-		assert(primitives.size() == (left_primitives.size() + right_primitives.size()));
+	split_axis = best_axis;
+	auto split = std::partition(infos.begin() + start, infos.begin() + end, [&](const auto& info) {
+		return bucket_of(info, best_axis) <= best_bucket;
+	});
+	mid = split - infos.begin();
 
-		node->left = build(left_primitives);
-		node->right = build(right_primitives);
+	return true;
+}
 
-		node->bound = Bound::merge(node->left->bound, node->right->bound);
-		node->area = node->left->area + node->right->area;
+int BVHAccel::flatten(BVHNode* node)
+{
+	int offset = nodes.size();
+	nodes.emplace_back();
+	nodes[offset].bound = node->bound;
+
+	if (node->num_primitives > 0) {
+		nodes[offset].primitives_offset = node->first_offset;
+		nodes[offset].num_primitives = node->num_primitives;
+	} else {
+		nodes[offset].split_axis = node->split_axis;
+		flatten(node->left);
+		nodes[offset].second_child_offset = flatten(node->right);
 	}
 
-	return node;
+	return offset;
+}
+
+template <int Width>
+int BVHAccel::collapse(int index)
+{
+	// open the largest interior child until the wide node is full or only leaves remain
+	std::array<int, Width> children{};
+	int                    count = 0;
+	if (nodes[index].num_primitives > 0) {
+		children[count++] = index;
+	} else {
+		children[count++] = index + 1;
+		children[count++] = nodes[index].second_child_offset;
+	}
+
+	while (count < Width) {
+		int    largest = -1;
+		double largest_area = -1.;
+		for (int i = 0; i < count; i++) {
+			const auto& child = nodes[children[i]];
+			if (child.num_primitives == 0 && child.bound.area() > largest_area) {
+				largest = i;
+				largest_area = child.bound.area();
+			}
+		}
+		if (largest < 0)
+			break;
+
+		int opened = children[largest];
+		children[largest] = opened + 1;
+		children[count++] = nodes[opened].second_child_offset;
+	}
+
+	auto& wide_nodes = wideNodes<Width>();
+	int   offset = wide_nodes.size();
+	wide_nodes.emplace_back();
+	for (int i = 0; i < Width; i++) {
+		// unused slots get an inverted box that no ray can enter
+		Bound child_bound = i < count ? nodes[children[i]].bound : Bound{};
+		for (int axis = 0; axis < 3; axis++) {
+			wide_nodes[offset].bmin[axis][i] = i < count ? child_bound.pmin[axis] : std::numeric_limits<float>::infinity();
+			wide_nodes[offset].bmax[axis][i] = i < count ? child_bound.pmax[axis] : -std::numeric_limits<float>::infinity();
+		}
+
+		if (i >= count) {
+			wide_nodes[offset].children[i] = 0;
+			wide_nodes[offset].counts[i] = -1;
+		} else if (nodes[children[i]].num_primitives > 0) {
+			wide_nodes[offset].children[i] = nodes[children[i]].primitives_offset;
+			wide_nodes[offset].counts[i] = nodes[children[i]].num_primitives;
+		} else {
+			int child = collapse<Width>(children[i]);
+			wide_nodes[offset].children[i] = child;
+			wide_nodes[offset].counts[i] = 0;
+		}
+	}
+
+	return offset;
+}
+
+template <int Width>
+std::vector<WideBVHNode<Width>>& BVHAccel::wideNodes()
+{
+	if constexpr (Width == 4)
+		return wide4_nodes;
+	else
+		return wide8_nodes;
+}
+
+template <int Width>
+const std::vector<WideBVHNode<Width>>& BVHAccel::wideNodes() const
+{
+	if constexpr (Width == 4)
+		return wide4_nodes;
+	else
+		return wide8_nodes;
 }
 
 void BVHAccel::destroy(BVHNode* node)
@@ -92,48 +476,517 @@ void BVHAccel::destroy(BVHNode* node)
 	delete node;
 }
 
-Intersection BVHAccel::intersect(const Ray& ray) const
+Bound BVHAccel::bound() const
+{
+	if (!nodes.empty())
+		return nodes.front().bound;
+
+	Bound res{};
+	auto  merge_root = [&](const auto& wide_nodes) {
+		if (wide_nodes.empty())
+			return;
+		const auto& root = wide_nodes.front();
+		for (int i = 0; i < std::ssize(root.counts); i++)
+			if (root.counts[i] >= 0)
+				res = Bound::merge(res, root.bound(i));
+	};
+	merge_root(wide4_nodes);
+	merge_root(wide8_nodes);
+
+	return res;
+}
+
+bool BVHAccel::intersect(const Ray& ray, HitRecord& hit) const
+{
+	float tmax = hit.t;
+	withKernels([&](auto kernels) {
+		using Kernels = decltype(kernels);
+		switch (LAYOUT) {
+		case BVHLayout::WIDE4:
+			intersectWide<Kernels, 4>(ray, hit);
+			break;
+		case BVHLayout::WIDE8:
+			intersectWide<Kernels, 8>(ray, hit);
+			break;
+		default:
+			intersectBinary<Kernels>(ray, hit);
+		}
+	});
+
+	return hit.t < tmax;
+}
+
+template <typename Kernels>
+void BVHAccel::intersectBinary(const Ray& ray, HitRecord& hit) const
+{
+	if (nodes.empty())
+		return;
+
+	vec3f_t            inv_dir = ray.direction.cwiseInverse();
+	std::array<int, 3> dir_is_neg = {inv_dir.x() < 0, inv_dir.y() < 0, inv_dir.z() < 0};
+
+	int to_visit[MAX_DEPTH];
+	int to_visit_offset = 0;
+	int current = 0;
+	while (true) {
+		const auto& node = nodes[current];
+		if (node.bound.intersectp(ray, inv_dir, dir_is_neg, hit.t)) {
+			if (node.num_primitives > 0) {
+				intersectLeaf<Kernels>(ray, node.primitives_offset, node.num_primitives, hit);
+				if (to_visit_offset == 0)
+					break;
+				current = to_visit[--to_visit_offset];
+			} else if (dir_is_neg[node.split_axis]) {
+				// visit the child nearer to the ray origin first
+				to_visit[to_visit_offset++] = current + 1;
+				current = node.second_child_offset;
+			} else {
+				to_visit[to_visit_offset++] = node.second_child_offset;
+				current = current + 1;
+			}
+		} else {
+			if (to_visit_offset == 0)
+				break;
+			current = to_visit[--to_visit_offset];
+		}
+	}
+}
+
+template <typename Kernels, int Width>
+void BVHAccel::intersectWide(const Ray& ray, HitRecord& hit) const
+{
+	struct StackEntry {
+		int   index;
+		int   count;
+		float tnear;
+	};
+
+	const auto& wide_nodes = wideNodes<Width>();
+	if (wide_nodes.empty())
+		return;
+
+	vec3f_t            inv_dir = ray.direction.cwiseInverse();
+	std::array<int, 3> dir_is_neg = {inv_dir.x() < 0, inv_dir.y() < 0, inv_dir.z() < 0};
+
+	StackEntry stack[MAX_DEPTH * Width];
+	int        stack_size = 0;
+	stack[stack_size++] = {0, 0, 0.f};
+	while (stack_size > 0) {
+		StackEntry entry = stack[--stack_size];
+		if (entry.tnear > hit.t)
+			continue;
+
+		if (entry.count > 0) {
+			intersectLeaf<Kernels>(ray, entry.index, entry.count, hit);
+			continue;
+		}
+
+		const auto& node = wide_nodes[entry.index];
+		alignas(32) float tnear[Width];
+		int               mask = node.template intersect<Kernels>(ray.origin, inv_dir, dir_is_neg, hit.t, tnear);
+
+		// push the hit children far to near so the nearest one is popped first
+		int order[Width];
+		int num_hits = 0;
+		for (; mask; mask &= mask - 1) {
+			int child = std::countr_zero(static_cast<unsigned>(mask));
+			int i = num_hits++;
+			for (; i > 0 && tnear[order[i - 1]] < tnear[child]; i--)
+				order[i] = order[i - 1];
+			order[i] = child;
+		}
+		for (int i = 0; i < num_hits; i++)
+			stack[stack_size++] = {node.children[order[i]], node.counts[order[i]], tnear[order[i]]};
+	}
+}
+
+template <typename Kernels>
+void BVHAccel::intersectLeaf(const Ray& ray, int offset, int count, HitRecord& hit) const
 {
-	if (!root)
+	if (primitive_types[offset] == PrimitiveType::TRIANGLE) {
+		float t = hit.t, u{}, v{};
+		int   index = intersectTriangles<Kernels>(ray, offset, count, t, u, v);
+		if (index >= 0)
+			hit = HitRecord{t, static_cast<uint32_t>(index), HitRecord::INVALID, u, v};
+		return;
+	}
+
+	forEachInLeaf(primitive_types[offset], ordered_primitives.data(), offset, count, [&](const auto* primitive, int index) {
+		primitive->intersect(ray, hit, index);
+	});
+}
+
+Intersection BVHAccel::getIntersection(const Ray& ray, const HitRecord& hit) const
+{
+	// the one place the surface of a hit is worked out, once per traced ray
+	if (!hit.hit())
 		return Intersection{};
 
-	return getIntersection(root, ray);
+	uint32_t index = hit.instance_id != HitRecord::INVALID ? hit.instance_id : hit.prim_id;
+	return ordered_primitives[index]->getIntersection(ray, hit);
+}
+
+bool BVHAccel::occluded(const Ray& ray, float tmax) const
+{
+	return withKernels([&](auto kernels) {
+		using Kernels = decltype(kernels);
+		switch (LAYOUT) {
+		case BVHLayout::WIDE4:
+			return occludedWide<Kernels, 4>(ray, tmax);
+		case BVHLayout::WIDE8:
+			return occludedWide<Kernels, 8>(ray, tmax);
+		default:
+			return occludedBinary<Kernels>(ray, tmax);
+		}
+	});
+}
+
+template <typename Kernels>
+bool BVHAccel::occludedBinary(const Ray& ray, float tmax) const
+{
+	if (nodes.empty())
+		return false;
+
+	vec3f_t            inv_dir = ray.direction.cwiseInverse();
+	std::array<int, 3> dir_is_neg = {inv_dir.x() < 0, inv_dir.y() < 0, inv_dir.z() < 0};
+
+	// any hit ends the query, so children are visited in storage order
+	int to_visit[MAX_DEPTH];
+	int to_visit_offset = 0;
+	int current = 0;
+	while (true) {
+		const auto& node = nodes[current];
+		if (node.bound.intersectp(ray, inv_dir, dir_is_neg, tmax)) {
+			if (node.num_primitives > 0) {
+				if (occludedLeaf<Kernels>(ray, node.primitives_offset, node.num_primitives, tmax))
+					return true;
+				if (to_visit_offset == 0)
+					break;
+				current = to_visit[--to_visit_offset];
+			} else {
+				to_visit[to_visit_offset++] = node.second_child_offset;
+				current = current + 1;
+			}
+		} else {
+			if (to_visit_offset == 0)
+				break;
+			current = to_visit[--to_visit_offset];
+		}
+	}
+
+	return false;
+}
+
+template <typename Kernels, int Width>
+bool BVHAccel::occludedWide(const Ray& ray, float tmax) const
+{
+	struct StackEntry {
+		int index;
+		int count;
+	};
+
+	const auto& wide_nodes = wideNodes<Width>();
+	if (wide_nodes.empty())
+		return false;
+
+	vec3f_t            inv_dir = ray.direction.cwiseInverse();
+	std::array<int, 3> dir_is_neg = {inv_dir.x() < 0, inv_dir.y() < 0, inv_dir.z() < 0};
+
+	StackEntry stack[MAX_DEPTH * Width];
+	int        stack_size = 0;
+	stack[stack_size++] = {0, 0};
+	while (stack_size > 0) {
+		StackEntry entry = stack[--stack_size];
+		if (entry.count > 0) {
+			if (occludedLeaf<Kernels>(ray, entry.index, entry.count, tmax))
+				return true;
+			continue;
+		}
+
+		const auto& node = wide_nodes[entry.index];
+		alignas(32) float tnear[Width];
+		for (int mask = node.template intersect<Kernels>(ray.origin, inv_dir, dir_is_neg, tmax, tnear); mask; mask &= mask - 1) {
+			int child = std::countr_zero(static_cast<unsigned>(mask));
+			stack[stack_size++] = {node.children[child], node.counts[child]};
+		}
+	}
+
+	return false;
+}
+
+template <typename Kernels>
+bool BVHAccel::occludedLeaf(const Ray& ray, int offset, int count, float tmax) const
+{
+	if (primitive_types[offset] == PrimitiveType::TRIANGLE) {
+		for (int block = offset / BVH_WIDTH; block <= (offset + count - 1) / BVH_WIDTH; block++) {
+			int   first = std::max(offset - block * BVH_WIDTH, 0);
+			int   last = std::min(offset + count - block * BVH_WIDTH, BVH_WIDTH);
+			int   mask = ((1 << last) - 1) & ~((1 << first) - 1);
+			float t, u, v;
+			if (triangle_blocks[block].intersect<Kernels>(ray.origin, ray.direction, tmax, mask, t, u, v) >= 0)
+				return true;
+		}
+		return false;
+	}
+
+	bool occluded = false;
+	forEachInLeaf(primitive_types[offset], ordered_primitives.data(), offset, count, [&](const auto* primitive, int) {
+		occluded = occluded || primitive->occluded(ray, tmax);
+	});
+
+	return occluded;
+}
+
+void BVHAccel::intersect(RayPacket& packet, uint32_t mask) const
+{
+	withKernels([&](auto kernels) {
+		using Kernels = decltype(kernels);
+		switch (LAYOUT) {
+		case BVHLayout::WIDE4:
+			intersectWide<Kernels, 4>(packet, mask);
+			break;
+		case BVHLayout::WIDE8:
+			intersectWide<Kernels, 8>(packet, mask);
+			break;
+		default:
+			intersectBinary<Kernels>(packet, mask);
+		}
+	});
+}
+
+template <typename Kernels>
+void BVHAccel::intersectBinary(RayPacket& packet, uint32_t mask) const
+{
+	struct StackEntry {
+		int      index;
+		uint32_t mask;
+	};
+
+	if (nodes.empty())
+		return;
+
+	StackEntry stack[MAX_DEPTH];
+	int        stack_size = 0;
+	stack[stack_size++] = {0, mask};
+	while (stack_size > 0) {
+		auto [index, active] = stack[--stack_size];
+
+		// the whole packet shares each node fetch, rays that miss drop out of the subtree
+		const auto& node = nodes[index];
+		float       tnear;
+		if (packet.missed(node.bound.pmin, node.bound.pmax) ||
+		    !(active = packet.intersect(node.bound.pmin, node.bound.pmax, active, tnear)))
+			continue;
+
+		if (node.num_primitives > 0) {
+			intersectLeaf<Kernels>(packet, node.primitives_offset, node.num_primitives, active);
+		} else if (packet.direction[node.split_axis][std::countr_zero(active)] < 0) {
+			stack[stack_size++] = {index + 1, active};
+			stack[stack_size++] = {node.second_child_offset, active};
+		} else {
+			stack[stack_size++] = {node.second_child_offset, active};
+			stack[stack_size++] = {index + 1, active};
+		}
+	}
 }
 
-Intersection BVHAccel::getIntersection(BVHNode* node, const Ray& ray) const
+template <typename Kernels, int Width>
+void BVHAccel::intersectWide(RayPacket& packet, uint32_t mask) const
 {
-	Intersection intersection;
+	struct StackEntry {
+		int      index;
+		int      count;
+		uint32_t mask;
+		float    tnear;
+	};
+
+	const auto& wide_nodes = wideNodes<Width>();
+	if (wide_nodes.empty())
+		return;
+
+	StackEntry stack[MAX_DEPTH * Width];
+	int        stack_size = 0;
+	stack[stack_size++] = {0, 0, mask, 0.f};
+	while (stack_size > 0) {
+		StackEntry entry = stack[--stack_size];
+
+		// rays that found something nearer since the push drop out
+		for (uint32_t m = entry.mask; m; m &= m - 1) {
+			int i = std::countr_zero(m);
+			if (packet.tmax[i] < entry.tnear)
+				entry.mask &= ~(1u << i);
+		}
+		if (!entry.mask)
+			continue;
 
-	vec3f_t inv_dir = ray.direction.cwiseInverse();
-	if (!node || !node->bound.intersectp(ray, inv_dir, {0, 0, 0}))
-		return intersection;
+		if (entry.count > 0) {
+			intersectLeaf<Kernels>(packet, entry.index, entry.count, entry.mask);
+			continue;
+		}
+
+		// children the packet's frustum misses are culled for all rays at once, each ray tests the rest
+		const auto& node = wide_nodes[entry.index];
+		int         children = ~node.missed(packet);
 
-	if (!node->left && !node->right)
-		return node->primitive->getIntersection(ray);
+		uint32_t child_masks[Width] = {};
+		float    child_tnear[Width];
+		std::fill(child_tnear, child_tnear + Width, std::numeric_limits<float>::max());
+		for (uint32_t m = entry.mask; m; m &= m - 1) {
+			int                i = std::countr_zero(m);
+			vec3f_t            origin(packet.origin[0][i], packet.origin[1][i], packet.origin[2][i]);
+			vec3f_t            inv_dir(packet.inv_dir[0][i], packet.inv_dir[1][i], packet.inv_dir[2][i]);
+			std::array<int, 3> dir_is_neg = {inv_dir.x() < 0, inv_dir.y() < 0, inv_dir.z() < 0};
+
+			alignas(32) float tnear[Width];
+			for (int mask = node.template intersect<Kernels>(origin, inv_dir, dir_is_neg, packet.tmax[i], tnear) & children; mask; mask &= mask - 1) {
+				int child = std::countr_zero(static_cast<unsigned>(mask));
+				child_masks[child] |= 1u << i;
+				child_tnear[child] = std::min(child_tnear[child], tnear[child]);
+			}
+		}
 
-	Intersection hit1 = getIntersection(node->left, ray);
-	Intersection hit2 = getIntersection(node->right, ray);
+		// push the hit children far to near by the nearest entry of any ray
+		StackEntry hits[Width];
+		int        num_hits = 0;
+		for (int child = 0; child < Width; child++) {
+			if (!child_masks[child])
+				continue;
 
-	return hit1.distance < hit2.distance ? hit1 : hit2;
+			int i = num_hits++;
+			for (; i > 0 && hits[i - 1].tnear < child_tnear[child]; i--)
+				hits[i] = hits[i - 1];
+			hits[i] = {node.children[child], node.counts[child], child_masks[child], child_tnear[child]};
+		}
+		for (int i = 0; i < num_hits; i++)
+			stack[stack_size++] = hits[i];
+	}
 }
 
-void BVHAccel::sample(Intersection& pos, float& pdf) const
+template <typename Kernels>
+int BVHAccel::intersectTriangles(const Ray& ray, int offset, int count, float& t, float& u, float& v) const
 {
-	float p = Geometry::randomFloat() * root->area;
-	getSample(root, p, pos, pdf);
-	pdf /= root->area;
+	// a leaf range may straddle block boundaries, lanes outside it are masked off
+	int nearest = -1;
+	for (int block = offset / BVH_WIDTH; block <= (offset + count - 1) / BVH_WIDTH; block++) {
+		int first = std::max(offset - block * BVH_WIDTH, 0);
+		int last = std::min(offset + count - block * BVH_WIDTH, BVH_WIDTH);
+		int mask = ((1 << last) - 1) & ~((1 << first) - 1);
+		int lane = triangle_blocks[block].intersect<Kernels>(ray.origin, ray.direction, t, mask, t, u, v);
+		if (lane >= 0)
+			nearest = block * BVH_WIDTH + lane;
+	}
+
+	return nearest;
 }
 
-void BVHAccel::getSample(BVHNode* node, float p, Intersection& pos, float& pdf) const
+template <typename Kernels>
+void BVHAccel::intersectLeaf(RayPacket& packet, int offset, int count, uint32_t mask) const
 {
-	if (!node->left && !node->right) {
-		node->primitive->sample(pos, pdf);
-		pdf *= node->area;
+	if (primitive_types[offset] == PrimitiveType::TRIANGLE) {
+		for (; mask; mask &= mask - 1) {
+			int   i = std::countr_zero(mask);
+			Ray   ray = packet.ray(i);
+			float t = packet.tmax[i], u{}, v{};
+			int   index = intersectTriangles<Kernels>(ray, offset, count, t, u, v);
+			if (index >= 0)
+				packet.record(i, HitRecord{t, static_cast<uint32_t>(index), HitRecord::INVALID, u, v});
+		}
 		return;
 	}
 
-	if (p < node->left->area)
-		getSample(node->left, p, pos, pdf);
-	else
-		getSample(node->right, p, pos, pdf);
+	forEachInLeaf(primitive_types[offset], ordered_primitives.data(), offset, count, [&](const auto* primitive, int index) {
+		primitive->intersect(packet, mask, index);
+	});
+}
+
+template <int Width>
+Bound WideBVHNode<Width>::bound(int child) const
+{
+	return Bound{vec3f_t(bmin[0][child], bmin[1][child], bmin[2][child]),
+	             vec3f_t(bmax[0][child], bmax[1][child], bmax[2][child])};
+}
+
+template <int Width>
+template <typename Kernels>
+int WideBVHNode<Width>::intersect(const vec3f_t& origin, const vec3f_t& inv_dir, const std::array<int, 3>& dir_is_neg,
+                                  float tmax, float* tnear) const
+{
+	// slab test against all children at once
+	return Kernels::intersectNode(bmin, bmax, origin.data(), inv_dir.data(), dir_is_neg.data(), tmax, tnear);
+}
+
+template <int Width>
+int WideBVHNode<Width>::missed(const RayPacket& packet) const
+{
+	if (!packet.coherent)
+		return 0;
+
+	// RayPacket::missed on every child at once
+	float t_enter[Width], t_exit[Width];
+	std::fill(t_enter, t_enter + Width, 0.f);
+	std::fill(t_exit, t_exit + Width, std::numeric_limits<float>::max());
+	for (int axis = 0; axis < 3; axis++) {
+		bool         neg = packet.inv_dir_max[axis] < 0;
+		const float* near_plane = neg ? bmax[axis] : bmin[axis];
+		const float* far_plane = neg ? bmin[axis] : bmax[axis];
+		const float  o_min = packet.origin_min[axis], o_max = packet.origin_max[axis];
+		const float  inv_min = packet.inv_dir_min[axis], inv_max = packet.inv_dir_max[axis];
+		for (int i = 0; i < Width; i++) {
+			float a = (near_plane[i] - o_max) * inv_min, b = (near_plane[i] - o_max) * inv_max;
+			float c = (near_plane[i] - o_min) * inv_min, d = (near_plane[i] - o_min) * inv_max;
+			t_enter[i] = std::max(t_enter[i], std::min(std::min(a, b), std::min(c, d)));
+
+			a = (far_plane[i] - o_max) * inv_min, b = (far_plane[i] - o_max) * inv_max;
+			c = (far_plane[i] - o_min) * inv_min, d = (far_plane[i] - o_min) * inv_max;
+			t_exit[i] = std::min(t_exit[i], std::max(std::max(a, b), std::max(c, d)));
+		}
+	}
+
+	int mask = 0;
+	for (int i = 0; i < Width; i++)
+		mask |= (t_enter[i] > t_exit[i]) << i;
+
+	return mask;
+}
+
+template struct WideBVHNode<4>;
+template struct WideBVHNode<8>;
+
+template <typename Kernels>
+int TriangleBlock::intersect(const vec3f_t& origin, const vec3f_t& direction, float tmax, int mask,
+                             float& t, float& u, float& v) const
+{
+	// Moller-Trumbore on every lane, culling back faces like Triangle::getIntersection
+	alignas(32) float ts[BVH_WIDTH], us[BVH_WIDTH], vs[BVH_WIDTH];
+	mask &= Kernels::intersectTriangles(v0, e1, e2, origin.data(), direction.data(), tmax, ts, us, vs);
+
+	int nearest = -1;
+	for (; mask; mask &= mask - 1) {
+		int i = std::countr_zero(static_cast<unsigned>(mask));
+		if (nearest < 0 || ts[i] < ts[nearest])
+			nearest = i;
+	}
+	if (nearest >= 0) {
+		t = ts[nearest];
+		u = us[nearest];
+		v = vs[nearest];
+	}
+
+	return nearest;
+}
+
+void BVHAccel::sample(Intersection& pos, float& pdf, Sampler& sampler) const
+{
+	if (area_cdf.empty())
+		return;
+
+	// pick a primitive proportionally to its area, then a point on it
+	float total_area = area_cdf.back();
+	float p = sampler.get1D() * total_area;
+	auto  it = std::upper_bound(area_cdf.begin(), area_cdf.end(), p);
+	int   index = std::min<int>(it - area_cdf.begin(), area_cdf.size() - 1);
+
+	auto* primitive = ordered_primitives[index];
+	primitive->sample(pos, pdf, sampler);
+	pdf *= primitive->area() / total_area;
 }
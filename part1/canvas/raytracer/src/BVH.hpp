@@ -1,44 +1,132 @@
 #pragma once
 
+#include "BVHKernels.hpp"
 #include "Bound.hpp"
 #include "Primitive.hpp"
+#include "ThreadPool.hpp"
 
 enum class BVHBuildMethod {
 	NAIVE,
 	SAH
 };
 
+enum class BVHLayout {
+	BINARY,
+	WIDE4,
+	WIDE8
+};
+
 struct BVHNode {
-	Bound      bound{};
-	BVHNode*   left{};
-	BVHNode*   right{};
-	Primitive* primitive{};
+	Bound    bound{};
+	BVHNode* left{};
+	BVHNode* right{};
 
-	int   split_axis{};
-	int   first_offset{};
-	int   num_primitives{};
-	float area{};
+	int split_axis{};
+	int first_offset{};
+	int num_primitives{};
+};
+
+struct BVHPrimitiveInfo {
+	int           index{};
+	PrimitiveType type{};
+	Bound         bound{};
+	vec3f_t       centroid;
+};
+
+// depth-first flattened node, the first child directly follows its parent
+struct alignas(32) LinearBVHNode {
+	Bound bound{};
+	union {
+		int primitives_offset;          // leaf
+		int second_child_offset;        // interior
+	};
+	uint16_t num_primitives{};
+	uint8_t  split_axis{};
+};
+
+static_assert(sizeof(LinearBVHNode) == 32);
+
+// collapsed node with the child boxes stored per axis, so one instruction covers every child
+template <int Width>
+struct alignas(32) WideBVHNode {
+	float bmin[3][Width];
+	float bmax[3][Width];
+	int   children[Width];        // wide node index, or primitives offset for a leaf
+	int   counts[Width];          // 0 for an interior child, number of primitives for a leaf, -1 if unused
+
+	auto bound(int child) const -> Bound;
+	template <typename Kernels>
+	auto intersect(const vec3f_t& origin, const vec3f_t& inv_dir, const std::array<int, 3>& dir_is_neg,
+	               float tmax, float* tnear) const -> int;
+	auto missed(const RayPacket& packet) const -> int;        // children no ray of a coherent packet can enter
+};
+
+// intersection-only copy of triangles in leaf order, a leaf test loads positions and edges and nothing else
+struct alignas(32) TriangleBlock {
+	float v0[3][BVH_WIDTH];
+	float e1[3][BVH_WIDTH];
+	float e2[3][BVH_WIDTH];
+
+	template <typename Kernels>
+	auto intersect(const vec3f_t& origin, const vec3f_t& direction, float tmax, int mask,
+	               float& t, float& u, float& v) const -> int;
 };
 
 struct BVHAccel {
-	BVHNode* root{};
+	std::vector<LinearBVHNode>  nodes;
+	std::vector<WideBVHNode<4>> wide4_nodes;
+	std::vector<WideBVHNode<8>> wide8_nodes;
+	std::vector<Primitive*>     ordered_primitives;
+	std::vector<PrimitiveType>  primitive_types;        // per ordered primitive, a leaf's type is that of its first
+	std::vector<TriangleBlock>  triangle_blocks;
+	std::vector<float>          area_cdf;
+
+	static constexpr int MAX_DEPTH = 64;        // leaves lie above it, so it bounds the traversal stacks
 
 	const int            MAX_PRIMITIVES_PER_LEAF;
 	const BVHBuildMethod BUILD_METHOD;
+	const BVHLayout      LAYOUT;
 
-	BVHAccel(std::vector<Primitive*> primitives,
-	         int                     max_primitives_per_leaf = 1,
-	         BVHBuildMethod          build_method = BVHBuildMethod::NAIVE);
-	~BVHAccel();
+	BVHAccel(const std::vector<Primitive*>& primitives,
+	         int                            max_primitives_per_leaf = 4,
+	         BVHBuildMethod                 build_method = BVHBuildMethod::NAIVE,
+	         int                            num_threads = 0,
+	         BVHLayout                      layout = BVHLayout::BINARY);
 
-	auto build(std::vector<Primitive*> primitives) -> BVHNode*;
+	auto build(std::vector<BVHPrimitiveInfo>& infos, int start, int end, int depth) -> BVHNode*;
+	auto buildParallel(std::vector<BVHPrimitiveInfo>& infos, int start, int end, int depth, int task_size,
+	                   ThreadPool& pool, std::vector<std::function<void()>>& subtrees) -> BVHNode*;
+	auto buildLeaf(std::vector<BVHPrimitiveInfo>& infos, BVHNode* node, int start, int end, int depth) -> BVHNode*;
+	bool split(std::vector<BVHPrimitiveInfo>& infos, int start, int end, int depth,
+	           const Bound& total_bound, const Bound& centroid_bound, int& split_axis, int& mid, ThreadPool* pool) const;
+	bool splitSAH(std::vector<BVHPrimitiveInfo>& infos, int start, int end,
+	              const Bound& total_bound, const Bound& centroid_bound, int& split_axis, int& mid, ThreadPool* pool) const;
+	auto flatten(BVHNode* node) -> int;
+	template <int Width> auto collapse(int index) -> int;
+	template <int Width> auto wideNodes() -> std::vector<WideBVHNode<Width>>&;
+	template <int Width> auto wideNodes() const -> const std::vector<WideBVHNode<Width>>&;
 	auto destroy(BVHNode* node) -> void;
 
 	auto bound() const -> Bound;
 
-	auto intersect(const Ray& ray) const -> Intersection;
-	auto getIntersection(BVHNode* node, const Ray& ray) const -> Intersection;
+	// each query picks the kernel set once and runs the traversal instantiated for it
+	auto intersect(const Ray& ray, HitRecord& hit) const -> bool;
+	template <typename Kernels> void intersectBinary(const Ray& ray, HitRecord& hit) const;
+	template <typename Kernels, int Width> void intersectWide(const Ray& ray, HitRecord& hit) const;
+	template <typename Kernels> void intersectLeaf(const Ray& ray, int offset, int count, HitRecord& hit) const;
+	template <typename Kernels> auto intersectTriangles(const Ray& ray, int offset, int count, float& t, float& u, float& v) const -> int;
+
+	auto occluded(const Ray& ray, float tmax) const -> bool;
+	template <typename Kernels> auto occludedBinary(const Ray& ray, float tmax) const -> bool;
+	template <typename Kernels, int Width> auto occludedWide(const Ray& ray, float tmax) const -> bool;
+	template <typename Kernels> auto occludedLeaf(const Ray& ray, int offset, int count, float tmax) const -> bool;
+
+	void intersect(RayPacket& packet, uint32_t mask) const;
+	template <typename Kernels> void intersectBinary(RayPacket& packet, uint32_t mask) const;
+	template <typename Kernels, int Width> void intersectWide(RayPacket& packet, uint32_t mask) const;
+	template <typename Kernels> void intersectLeaf(RayPacket& packet, int offset, int count, uint32_t mask) const;
+
+	auto getIntersection(const Ray& ray, const HitRecord& hit) const -> Intersection;
 
-	void sample(Intersection& pos, float& pdf) const;
-	void getSample(BVHNode* node, float p, Intersection& pos, float& pdf) const;
+	void sample(Intersection& pos, float& pdf, Sampler& sampler) const;
 };
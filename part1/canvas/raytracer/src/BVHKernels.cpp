@@ -0,0 +1,23 @@
+#include "BVHKernels.hpp"
+
+#if defined(BVH_KERNELS_AVX) && defined(_MSC_VER)
+#	include <intrin.h>
+#endif
+
+BVHInstructionSet selectBVHInstructionSet()
+{
+#if defined(BVH_KERNELS_AVX)
+#	if defined(_MSC_VER)
+	// the cpu has AVX and the os saves its registers on a context switch
+	int info[4];
+	__cpuid(info, 1);
+	bool avx = (info[2] & (1 << 28)) && (info[2] & (1 << 27)) && (_xgetbv(0) & 6) == 6;
+#	else
+	bool avx = __builtin_cpu_supports("avx");
+#	endif
+
+	return avx ? BVHInstructionSet::AVX : BVHInstructionSet::SSE;
+#else
+	return BVHInstructionSet::SCALAR;
+#endif
+}
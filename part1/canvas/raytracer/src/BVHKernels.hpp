@@ -0,0 +1,222 @@
+#pragma once
+
+#if defined(__x86_64__) || defined(_M_X64)
+#	define BVH_KERNELS_AVX
+#	include <immintrin.h>
+#endif
+
+// only the AVX kernels and the traversals flattening them in are compiled for AVX, the rest runs on any x86-64 cpu
+#if defined(_MSC_VER) && !defined(__clang__)
+#	define BVH_TARGET_AVX
+#	define BVH_TARGET_AVX_FLATTEN [[msvc::flatten]]
+#else
+#	define BVH_TARGET_AVX         [[gnu::target("avx")]]
+#	define BVH_TARGET_AVX_FLATTEN [[gnu::target("avx"), gnu::flatten]]
+#endif
+
+// triangles per block and children of the widest node, two SSE registers or one AVX register
+constexpr int BVH_WIDTH = 8;
+
+template <int Width>
+using Lanes = float[3][Width];
+
+enum class BVHInstructionSet {
+	SCALAR,
+	SSE,
+	AVX
+};
+
+auto selectBVHInstructionSet() -> BVHInstructionSet;        // the widest the cpu runs
+
+// one ray against every lane, returning the lanes entered or hit before tmax; the running bounds are the second operand of
+// every max and min, so the NaN of a ray lying in a slab plane never enters a lane
+struct ScalarKernels {
+	template <int Width>
+	static int intersectNode(const Lanes<Width>& bmin, const Lanes<Width>& bmax, const float* origin, const float* inv_dir,
+	                         const int* dir_is_neg, float tmax, float* tnear)
+	{
+		int mask = 0;
+		for (int i = 0; i < Width; i++) {
+			float t_enter = 0.f;
+			float t_exit = tmax;
+			for (int axis = 0; axis < 3; axis++) {
+				float t_near = ((dir_is_neg[axis] ? bmax : bmin)[axis][i] - origin[axis]) * inv_dir[axis];
+				float t_far = ((dir_is_neg[axis] ? bmin : bmax)[axis][i] - origin[axis]) * inv_dir[axis];
+				t_enter = t_near > t_enter ? t_near : t_enter;
+				t_exit = t_far < t_exit ? t_far : t_exit;
+			}
+			tnear[i] = t_enter;
+			mask |= (t_enter <= t_exit) << i;
+		}
+
+		return mask;
+	}
+
+	static int intersectTriangles(const Lanes<BVH_WIDTH>& v0, const Lanes<BVH_WIDTH>& e1, const Lanes<BVH_WIDTH>& e2,
+	                              const float* origin, const float* direction, float tmax, float* t, float* u, float* v)
+	{
+		constexpr float EPSILON = 1e-8f;
+
+		int mask = 0;
+		for (int i = 0; i < BVH_WIDTH; i++) {
+			float tvec[3] = {origin[0] - v0[0][i], origin[1] - v0[1][i], origin[2] - v0[2][i]};
+			float pvec[3] = {direction[1] * e2[2][i] - direction[2] * e2[1][i],
+			                 direction[2] * e2[0][i] - direction[0] * e2[2][i],
+			                 direction[0] * e2[1][i] - direction[1] * e2[0][i]};
+			float qvec[3] = {tvec[1] * e1[2][i] - tvec[2] * e1[1][i],
+			                 tvec[2] * e1[0][i] - tvec[0] * e1[2][i],
+			                 tvec[0] * e1[1][i] - tvec[1] * e1[0][i]};
+			float det = e1[0][i] * pvec[0] + e1[1][i] * pvec[1] + e1[2][i] * pvec[2];
+			float inv_det = 1.f / det;
+			u[i] = (tvec[0] * pvec[0] + tvec[1] * pvec[1] + tvec[2] * pvec[2]) * inv_det;
+			v[i] = (direction[0] * qvec[0] + direction[1] * qvec[1] + direction[2] * qvec[2]) * inv_det;
+			t[i] = (e2[0][i] * qvec[0] + e2[1][i] * qvec[1] + e2[2][i] * qvec[2]) * inv_det;
+			if (det >= EPSILON && u[i] >= 0.f && v[i] >= 0.f && u[i] + v[i] <= 1.f && t[i] >= 0.f && t[i] < tmax)
+				mask |= 1 << i;
+		}
+
+		return mask;
+	}
+};
+
+#if defined(BVH_KERNELS_AVX)
+// four lanes per register
+struct SSEKernels {
+	template <int Width>
+	static int intersectNode(const Lanes<Width>& bmin, const Lanes<Width>& bmax, const float* origin, const float* inv_dir,
+	                         const int* dir_is_neg, float tmax, float* tnear)
+	{
+		int mask = 0;
+		for (int j = 0; j < Width; j += 4) {
+			__m128 t_enter = _mm_setzero_ps();
+			__m128 t_exit = _mm_set1_ps(tmax);
+			for (int axis = 0; axis < 3; axis++) {
+				__m128 o = _mm_set1_ps(origin[axis]);
+				__m128 inv = _mm_set1_ps(inv_dir[axis]);
+				__m128 near_plane = _mm_load_ps((dir_is_neg[axis] ? bmax : bmin)[axis] + j);
+				__m128 far_plane = _mm_load_ps((dir_is_neg[axis] ? bmin : bmax)[axis] + j);
+				t_enter = _mm_max_ps(_mm_mul_ps(_mm_sub_ps(near_plane, o), inv), t_enter);
+				t_exit = _mm_min_ps(_mm_mul_ps(_mm_sub_ps(far_plane, o), inv), t_exit);
+			}
+			_mm_store_ps(tnear + j, t_enter);
+			mask |= _mm_movemask_ps(_mm_cmple_ps(t_enter, t_exit)) << j;
+		}
+
+		return mask;
+	}
+
+	static int intersectTriangles(const Lanes<BVH_WIDTH>& v0, const Lanes<BVH_WIDTH>& e1, const Lanes<BVH_WIDTH>& e2,
+	                              const float* origin, const float* direction, float tmax, float* t, float* u, float* v)
+	{
+		constexpr float EPSILON = 1e-8f;
+
+		auto dot = [](__m128 ax, __m128 ay, __m128 az, __m128 bx, __m128 by, __m128 bz) {
+			return _mm_add_ps(_mm_add_ps(_mm_mul_ps(ax, bx), _mm_mul_ps(ay, by)), _mm_mul_ps(az, bz));
+		};
+
+		int mask = 0;
+		for (int j = 0; j < BVH_WIDTH; j += 4) {
+			__m128 dx = _mm_set1_ps(direction[0]), dy = _mm_set1_ps(direction[1]), dz = _mm_set1_ps(direction[2]);
+			__m128 e1x = _mm_load_ps(e1[0] + j), e1y = _mm_load_ps(e1[1] + j), e1z = _mm_load_ps(e1[2] + j);
+			__m128 e2x = _mm_load_ps(e2[0] + j), e2y = _mm_load_ps(e2[1] + j), e2z = _mm_load_ps(e2[2] + j);
+			__m128 tx = _mm_sub_ps(_mm_set1_ps(origin[0]), _mm_load_ps(v0[0] + j));
+			__m128 ty = _mm_sub_ps(_mm_set1_ps(origin[1]), _mm_load_ps(v0[1] + j));
+			__m128 tz = _mm_sub_ps(_mm_set1_ps(origin[2]), _mm_load_ps(v0[2] + j));
+
+			__m128 px = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(dz, e2y));
+			__m128 py = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(dx, e2z));
+			__m128 pz = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(dy, e2x));
+			__m128 qx = _mm_sub_ps(_mm_mul_ps(ty, e1z), _mm_mul_ps(tz, e1y));
+			__m128 qy = _mm_sub_ps(_mm_mul_ps(tz, e1x), _mm_mul_ps(tx, e1z));
+			__m128 qz = _mm_sub_ps(_mm_mul_ps(tx, e1y), _mm_mul_ps(ty, e1x));
+
+			__m128 det = dot(e1x, e1y, e1z, px, py, pz);
+			__m128 inv_det = _mm_div_ps(_mm_set1_ps(1.f), det);
+			__m128 uu = _mm_mul_ps(dot(tx, ty, tz, px, py, pz), inv_det);
+			__m128 vv = _mm_mul_ps(dot(dx, dy, dz, qx, qy, qz), inv_det);
+			__m128 tt = _mm_mul_ps(dot(e2x, e2y, e2z, qx, qy, qz), inv_det);
+
+			__m128 zero = _mm_setzero_ps();
+			__m128 valid = _mm_cmpge_ps(det, _mm_set1_ps(EPSILON));
+			valid = _mm_and_ps(valid, _mm_cmpge_ps(uu, zero));
+			valid = _mm_and_ps(valid, _mm_cmpge_ps(vv, zero));
+			valid = _mm_and_ps(valid, _mm_cmple_ps(_mm_add_ps(uu, vv), _mm_set1_ps(1.f)));
+			valid = _mm_and_ps(valid, _mm_cmpge_ps(tt, zero));
+			valid = _mm_and_ps(valid, _mm_cmplt_ps(tt, _mm_set1_ps(tmax)));
+			mask |= _mm_movemask_ps(valid) << j;
+
+			_mm_store_ps(t + j, tt);
+			_mm_store_ps(u + j, uu);
+			_mm_store_ps(v + j, vv);
+		}
+
+		return mask;
+	}
+};
+
+// eight lanes per register, four wide nodes take the SSE test
+struct AVXKernels {
+	template <int Width>
+	BVH_TARGET_AVX static int intersectNode(const Lanes<Width>& bmin, const Lanes<Width>& bmax, const float* origin,
+	                                        const float* inv_dir, const int* dir_is_neg, float tmax, float* tnear)
+	{
+		if constexpr (Width == 4) {
+			return SSEKernels::intersectNode(bmin, bmax, origin, inv_dir, dir_is_neg, tmax, tnear);
+		} else {
+			__m256 t_enter = _mm256_setzero_ps();
+			__m256 t_exit = _mm256_set1_ps(tmax);
+			for (int axis = 0; axis < 3; axis++) {
+				__m256 o = _mm256_set1_ps(origin[axis]);
+				__m256 inv = _mm256_set1_ps(inv_dir[axis]);
+				__m256 near_plane = _mm256_load_ps(dir_is_neg[axis] ? bmax[axis] : bmin[axis]);
+				__m256 far_plane = _mm256_load_ps(dir_is_neg[axis] ? bmin[axis] : bmax[axis]);
+				t_enter = _mm256_max_ps(_mm256_mul_ps(_mm256_sub_ps(near_plane, o), inv), t_enter);
+				t_exit = _mm256_min_ps(_mm256_mul_ps(_mm256_sub_ps(far_plane, o), inv), t_exit);
+			}
+			_mm256_store_ps(tnear, t_enter);
+
+			return _mm256_movemask_ps(_mm256_cmp_ps(t_enter, t_exit, _CMP_LE_OQ));
+		}
+	}
+
+	BVH_TARGET_AVX static int intersectTriangles(const Lanes<BVH_WIDTH>& v0, const Lanes<BVH_WIDTH>& e1, const Lanes<BVH_WIDTH>& e2,
+	                                             const float* origin, const float* direction, float tmax, float* t, float* u, float* v)
+	{
+		constexpr float EPSILON = 1e-8f;
+
+		__m256 dx = _mm256_set1_ps(direction[0]), dy = _mm256_set1_ps(direction[1]), dz = _mm256_set1_ps(direction[2]);
+		__m256 e1x = _mm256_load_ps(e1[0]), e1y = _mm256_load_ps(e1[1]), e1z = _mm256_load_ps(e1[2]);
+		__m256 e2x = _mm256_load_ps(e2[0]), e2y = _mm256_load_ps(e2[1]), e2z = _mm256_load_ps(e2[2]);
+		__m256 tx = _mm256_sub_ps(_mm256_set1_ps(origin[0]), _mm256_load_ps(v0[0]));
+		__m256 ty = _mm256_sub_ps(_mm256_set1_ps(origin[1]), _mm256_load_ps(v0[1]));
+		__m256 tz = _mm256_sub_ps(_mm256_set1_ps(origin[2]), _mm256_load_ps(v0[2]));
+
+		__m256 px = _mm256_sub_ps(_mm256_mul_ps(dy, e2z), _mm256_mul_ps(dz, e2y));
+		__m256 py = _mm256_sub_ps(_mm256_mul_ps(dz, e2x), _mm256_mul_ps(dx, e2z));
+		__m256 pz = _mm256_sub_ps(_mm256_mul_ps(dx, e2y), _mm256_mul_ps(dy, e2x));
+		__m256 qx = _mm256_sub_ps(_mm256_mul_ps(ty, e1z), _mm256_mul_ps(tz, e1y));
+		__m256 qy = _mm256_sub_ps(_mm256_mul_ps(tz, e1x), _mm256_mul_ps(tx, e1z));
+		__m256 qz = _mm256_sub_ps(_mm256_mul_ps(tx, e1y), _mm256_mul_ps(ty, e1x));
+
+		__m256 det = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e1x, px), _mm256_mul_ps(e1y, py)), _mm256_mul_ps(e1z, pz));
+		__m256 inv_det = _mm256_div_ps(_mm256_set1_ps(1.f), det);
+		__m256 uu = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(tx, px), _mm256_mul_ps(ty, py)), _mm256_mul_ps(tz, pz)), inv_det);
+		__m256 vv = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, qx), _mm256_mul_ps(dy, qy)), _mm256_mul_ps(dz, qz)), inv_det);
+		__m256 tt = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e2x, qx), _mm256_mul_ps(e2y, qy)), _mm256_mul_ps(e2z, qz)), inv_det);
+
+		__m256 zero = _mm256_setzero_ps();
+		__m256 valid = _mm256_cmp_ps(det, _mm256_set1_ps(EPSILON), _CMP_GE_OQ);
+		valid = _mm256_and_ps(valid, _mm256_cmp_ps(uu, zero, _CMP_GE_OQ));
+		valid = _mm256_and_ps(valid, _mm256_cmp_ps(vv, zero, _CMP_GE_OQ));
+		valid = _mm256_and_ps(valid, _mm256_cmp_ps(_mm256_add_ps(uu, vv), _mm256_set1_ps(1.f), _CMP_LE_OQ));
+		valid = _mm256_and_ps(valid, _mm256_cmp_ps(tt, zero, _CMP_GE_OQ));
+		valid = _mm256_and_ps(valid, _mm256_cmp_ps(tt, _mm256_set1_ps(tmax), _CMP_LT_OQ));
+
+		_mm256_store_ps(t, tt);
+		_mm256_store_ps(u, uu);
+		_mm256_store_ps(v, vv);
+
+		return _mm256_movemask_ps(valid);
+	}
+};
+#endif
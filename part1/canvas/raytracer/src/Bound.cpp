@@ -53,16 +53,29 @@ Bound Bound::intersect(const Bound& b) const
 	    pmax.cwiseMin(b.pmax)};
 }
 
-bool Bound::intersectp(const Ray& ray, const vec3f_t inv_dir, const std::array<int, 3>& dir_is_neg) const
+bool Bound::intersectp(const Ray& ray, const vec3f_t& inv_dir, const std::array<int, 3>& dir_is_neg, float tmax) const
 {
-	vec3f_t v1 = (pmin - ray.origin).cwiseProduct(inv_dir);
-	vec3f_t v2 = (pmax - ray.origin).cwiseProduct(inv_dir);
-	vec3f_t tmin = v1.cwiseMin(v2);
-	vec3f_t tmax = v1.cwiseMax(v2);
-	float   tenter = std::max({tmin.x(), tmin.y(), tmin.z()});
-	float   texit = std::min({tmax.x(), tmax.y(), tmax.z()});
-
-	return (tenter <= texit && texit >= 0);
+	// the sign of each direction component tells which slab plane is entered first
+	const vec3f_t& near_x = dir_is_neg[0] ? pmax : pmin;
+	const vec3f_t& far_x = dir_is_neg[0] ? pmin : pmax;
+	const vec3f_t& near_y = dir_is_neg[1] ? pmax : pmin;
+	const vec3f_t& far_y = dir_is_neg[1] ? pmin : pmax;
+	const vec3f_t& near_z = dir_is_neg[2] ? pmax : pmin;
+	const vec3f_t& far_z = dir_is_neg[2] ? pmin : pmax;
+
+	float tenter = (near_x.x() - ray.origin.x()) * inv_dir.x();
+	float texit = (far_x.x() - ray.origin.x()) * inv_dir.x();
+	float ty_enter = (near_y.y() - ray.origin.y()) * inv_dir.y();
+	float ty_exit = (far_y.y() - ray.origin.y()) * inv_dir.y();
+	float tz_enter = (near_z.z() - ray.origin.z()) * inv_dir.z();
+	float tz_exit = (far_z.z() - ray.origin.z()) * inv_dir.z();
+
+	tenter = ty_enter > tenter ? ty_enter : tenter;
+	tenter = tz_enter > tenter ? tz_enter : tenter;
+	texit = ty_exit < texit ? ty_exit : texit;
+	texit = tz_exit < texit ? tz_exit : texit;
+
+	return tenter <= texit && texit >= 0 && tenter < tmax;
 }
 
 bool Bound::overlaps(const Bound& b1, const Bound& b2)
@@ -81,14 +94,19 @@ bool Bound::inside(const vec3f_t& p, const Bound& b)
 
 Bound Bound::merge(const Bound& b1, const Bound& b2)
 {
-	return Bound{
-	    b1.pmin.cwiseMin(b2.pmin),
-	    b1.pmax.cwiseMax(b2.pmax)};
+	// assign directly, the two point constructor would sort the corners again
+	Bound res;
+	res.pmin = b1.pmin.cwiseMin(b2.pmin);
+	res.pmax = b1.pmax.cwiseMax(b2.pmax);
+
+	return res;
 }
 
 Bound Bound::merge(const Bound& b, const vec3f_t& p)
 {
-	return Bound{
-	    b.pmin.cwiseMin(p),
-	    b.pmax.cwiseMax(p)};
+	Bound res;
+	res.pmin = b.pmin.cwiseMin(p);
+	res.pmax = b.pmax.cwiseMax(p);
+
+	return res;
 }
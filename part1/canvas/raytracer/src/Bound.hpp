@@ -1,5 +1,6 @@
 #pragma once
 
+#include <array>
 #include <limits>
 
 #include "global.hpp"
@@ -9,9 +10,9 @@ struct Bound {
 	vec3f_t pmin{std::numeric_limits<float>::max(),
 	             std::numeric_limits<float>::max(),
 	             std::numeric_limits<float>::max()};
-	vec3f_t pmax{std::numeric_limits<float>::min(),
-	             std::numeric_limits<float>::min(),
-	             std::numeric_limits<float>::min()};
+	vec3f_t pmax{std::numeric_limits<float>::lowest(),
+	             std::numeric_limits<float>::lowest(),
+	             std::numeric_limits<float>::lowest()};
 
 	Bound() = default;
 	Bound(const vec3f_t& p1, const vec3f_t& p2);
@@ -23,8 +24,8 @@ struct Bound {
 	int     maxextent() const;
 
 	Bound intersect(const Bound& b) const;
-	bool  intersectp(const Ray& ray, const vec3f_t inv_dir,
-	                 const std::array<int, 3>& dir_is_neg) const;
+	bool  intersectp(const Ray& ray, const vec3f_t& inv_dir, const std::array<int, 3>& dir_is_neg,
+	                 float tmax = std::numeric_limits<float>::max()) const;
 
 	static bool  overlaps(const Bound& b1, const Bound& b2);
 	static bool  inside(const vec3f_t& p, const Bound& b);
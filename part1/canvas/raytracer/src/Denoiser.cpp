@@ -0,0 +1,137 @@
+#include "Denoiser.hpp"
+
+namespace
+{
+// what the image is divided by before filtering, 1 where there is no albedo to take out
+vec3f_t demodulation(const vec3f_t& albedo)
+{
+	constexpr float MIN_ALBEDO = 0.01f;
+
+	return vec3f_t(albedo.x() > MIN_ALBEDO ? albedo.x() : 1.f, albedo.y() > MIN_ALBEDO ? albedo.y() : 1.f,
+	               albedo.z() > MIN_ALBEDO ? albedo.z() : 1.f);
+}
+};        // namespace
+
+void AOVBuffers::resize(int pixels)
+{
+	albedo.resize(pixels);
+	normals.resize(pixels);
+	depths.resize(pixels);
+	primitive_ids.resize(pixels);
+	emissive.resize(pixels);
+}
+
+Denoiser::Denoiser(int width, int height, int num_threads)
+    : width(width), height(height), pool(num_threads)
+{
+	irradiance.resize(width * height);
+	filtered.resize(width * height);
+	variance.resize(width * height);
+	filtered_variance.resize(width * height);
+}
+
+void Denoiser::apply(std::vector<vec3f_t>& image, const AOVBuffers& aovs)
+{
+	constexpr float KERNEL[3] = {3.f / 8.f, 1.f / 4.f, 1.f / 16.f};
+	constexpr float EPSILON = 1e-4f;
+
+	for (int p = 0; p < width * height; p++)
+		irradiance[p] = image[p].cwiseQuotient(demodulation(aovs.albedo[p]));
+	estimateVariance(aovs);
+
+	// every pass reads the last one's result whole and writes the other buffers, so rows can go to any thread
+	for (int iteration = 0; iteration < iterations; iteration++) {
+		const int step = 1 << iteration;
+		pool.parallelFor(0, height, [&](int, int y0, int y1) {
+			for (int j = y0; j < y1; j++) {
+				for (int i = 0; i < width; i++) {
+					const int p = j * width + i;
+					if (aovs.emissive[p]) {
+						filtered[p] = irradiance[p];
+						filtered_variance[p] = variance[p];
+						continue;
+					}
+
+					const vec3f_t& normal = aovs.normals[p];
+					const vec3f_t& albedo = aovs.albedo[p];
+					const float    depth = aovs.depths[p];
+					const float    luminance = Geometry::luminance(irradiance[p]);
+					const float    color_scale = sigma_color * std::sqrt(std::max(variance[p], 0.f)) + EPSILON;
+
+					vec3f_t sum = vec3f_t::Zero();
+					float   weight_sum = 0.f;
+					float   variance_sum = 0.f;
+					for (int dy = -2; dy <= 2; dy++) {
+						int y = j + dy * step;
+						if (y < 0 || y >= height)
+							continue;
+
+						for (int dx = -2; dx <= 2; dx++) {
+							int x = i + dx * step;
+							if (x < 0 || x >= width)
+								continue;
+
+							// taps on another primitive never count, the rest fade with how far their surface and light differ
+							int q = y * width + x;
+							if (aovs.primitive_ids[q] != aovs.primitive_ids[p] || aovs.emissive[q])
+								continue;
+
+							float distance = step * std::sqrt(static_cast<float>(dx * dx + dy * dy));
+							float color_difference = std::fabs(Geometry::luminance(irradiance[q]) - luminance) / color_scale;
+							float depth_difference = std::fabs(aovs.depths[q] - depth) / (sigma_depth * depth * distance + EPSILON);
+							float albedo_difference = (aovs.albedo[q] - albedo).squaredNorm() / (sigma_albedo * sigma_albedo);
+							float weight = KERNEL[std::abs(dx)] * KERNEL[std::abs(dy)] *
+							               std::pow(std::max(0.f, aovs.normals[q].dot(normal)), sigma_normal) *
+							               std::exp(-color_difference - depth_difference - albedo_difference);
+
+							sum += irradiance[q] * weight;
+							weight_sum += weight;
+							variance_sum += weight * weight * variance[q];
+						}
+					}
+
+					// the noise left is that of the weighted mean, so later iterations ask for closer agreement
+					filtered[p] = weight_sum > 0.f ? vec3f_t(sum / weight_sum) : irradiance[p];
+					filtered_variance[p] = weight_sum > 0.f ? variance_sum / (weight_sum * weight_sum) : variance[p];
+				}
+			}
+		});
+		std::swap(irradiance, filtered);
+		std::swap(variance, filtered_variance);
+	}
+
+	for (int p = 0; p < width * height; p++)
+		image[p] = irradiance[p].cwiseProduct(demodulation(aovs.albedo[p]));
+}
+
+void Denoiser::estimateVariance(const AOVBuffers& aovs)
+{
+	constexpr int RADIUS = 3;
+
+	// the spread of luminance over the pixels around on the same primitive, most of which is noise on a smooth surface
+	pool.parallelFor(0, height, [&](int, int y0, int y1) {
+		for (int j = y0; j < y1; j++) {
+			for (int i = 0; i < width; i++) {
+				int    p = j * width + i;
+				double sum = 0.0;
+				double sum_squares = 0.0;
+				int    count = 0;
+				for (int y = std::max(j - RADIUS, 0); y <= std::min(j + RADIUS, height - 1); y++) {
+					for (int x = std::max(i - RADIUS, 0); x <= std::min(i + RADIUS, width - 1); x++) {
+						int q = y * width + x;
+						if (aovs.primitive_ids[q] != aovs.primitive_ids[p] || aovs.emissive[q])
+							continue;
+
+						double luminance = Geometry::luminance(irradiance[q]);
+						sum += luminance;
+						sum_squares += luminance * luminance;
+						count++;
+					}
+				}
+
+				double mean = sum / std::max(count, 1);
+				variance[p] = static_cast<float>(std::max(sum_squares / std::max(count, 1) - mean * mean, 0.0));
+			}
+		}
+	});
+}
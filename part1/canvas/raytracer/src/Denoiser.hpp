@@ -0,0 +1,46 @@
+#pragma once
+
+#include <vector>
+
+#include "ThreadPool.hpp"
+#include "global.hpp"
+
+// what the camera rays of each pixel hit first, averaged over a few of its sub-samples so edges line up with the image
+struct AOVBuffers {
+	std::vector<vec3f_t>  albedo;
+	std::vector<vec3f_t>  normals;
+	std::vector<float>    depths;               // along the camera ray, 0 where nothing was hit
+	std::vector<uint32_t> primitive_ids;        // scene level primitive, HitRecord::INVALID where nothing was hit
+	std::vector<uint8_t>  emissive;             // an emitter was seen, the pixel is left as rendered and filters nothing
+
+	void resize(int pixels);
+};
+
+// Dammertz et al.'s edge-avoiding a-trous wavelet filter: a 5x5 B3 spline kernel whose taps spread twice as far every
+// iteration, each tap weighted down across edges of the first hit buffers and across changes in the image larger than
+// its noise, which is estimated from the pixels around as in Schied et al.'s SVGF and filtered along with it; the image
+// is filtered divided by its albedo, so textures and colour edges come back sharp
+class Denoiser {
+public:
+	int   iterations{4};
+	float sigma_color{4.f};          // in standard deviations of the noise
+	float sigma_normal{64.f};        // exponent on the cosine between normals
+	float sigma_depth{.01f};         // relative change in depth per pixel of tap distance
+	float sigma_albedo{.1f};
+
+	Denoiser(int width, int height, int num_threads);
+
+	void apply(std::vector<vec3f_t>& image, const AOVBuffers& aovs);
+
+private:
+	int        width;
+	int        height;
+	ThreadPool pool;
+
+	std::vector<vec3f_t> irradiance;
+	std::vector<vec3f_t> filtered;
+	std::vector<float>   variance;                // of each pixel's luminance
+	std::vector<float>   filtered_variance;
+
+	void estimateVariance(const AOVBuffers& aovs);
+};
@@ -0,0 +1,167 @@
+#include "Instance.hpp"
+
+#include <bit>
+#include <limits>
+
+Instance::Instance(Model* model, const mat4f_t& transform, Material* material) :
+    model(model),
+    material(material),
+    transform(transform),
+    inverse(transform.inverse()),
+    normal_matrix(transform.block<3, 3>(0, 0).inverse().transpose())
+{
+	// an affine transform keeps the transformed box corners as a conservative bound
+	Bound object_bound = model->bound();
+	for (int i = 0; i < 8; i++) {
+		vec3f_t corner((i & 1) ? object_bound.pmax.x() : object_bound.pmin.x(),
+		               (i & 2) ? object_bound.pmax.y() : object_bound.pmin.y(),
+		               (i & 4) ? object_bound.pmax.z() : object_bound.pmin.z());
+		world_bound = Bound::merge(world_bound, toWorld(corner));
+	}
+
+	for (const auto& triangle : model->triangles)
+		world_area += 0.5f * (toWorld(triangle.v1) - toWorld(triangle.v0)).cross(toWorld(triangle.v2) - toWorld(triangle.v0)).norm();
+}
+
+PrimitiveType Instance::type() const
+{
+	return PrimitiveType::INSTANCE;
+}
+
+Bound Instance::bound() const
+{
+	return world_bound;
+}
+
+float Instance::area() const
+{
+	return world_area;
+}
+
+void Instance::sample(Intersection& pos, float& pdf, Sampler& sampler)
+{
+	model->sample(pos, pdf, sampler);
+
+	// the model samples uniformly by object space area, rescale by how much the sampled triangle was stretched
+	auto* triangle = static_cast<Triangle*>(pos.primitive);
+	float world_triangle_area = 0.5f * (toWorld(triangle->v1) - toWorld(triangle->v0)).cross(toWorld(triangle->v2) - toWorld(triangle->v0)).norm();
+	pdf *= triangle->sarea / world_triangle_area;
+
+	pos.position = toWorld(pos.position);
+	pos.normal = (normal_matrix * pos.normal).normalized();
+	if (material) {
+		pos.material = material;
+		pos.emit = material->emission;
+	}
+}
+
+bool Instance::intersect(const Ray& ray) const
+{
+	// whether the ray hits the model anywhere ahead, the any-hit query without a distance limit
+	return occluded(ray, std::numeric_limits<float>::max());
+}
+
+bool Instance::intersect(const Ray& ray, float& tnear, uint32_t& index) const
+{
+	return model->intersect(toObject(ray), tnear, index);
+}
+
+bool Instance::intersect(const Ray& ray, HitRecord& hit, uint32_t index) const
+{
+	// the object space direction is not renormalized, so distances stay in world units
+	return model->intersect(toObject(ray), hit, index);
+}
+
+Intersection Instance::getIntersection(const Ray& ray, const HitRecord& hit)
+{
+	Intersection intersection = model->getIntersection(toObject(ray), hit);
+	intersection.position = ray.at(hit.t);
+	intersection.normal = (normal_matrix * intersection.normal).normalized();
+	if (material)
+		intersection.material = material;
+
+	return intersection;
+}
+
+void Instance::intersect(RayPacket& packet, uint32_t mask, uint32_t index) const
+{
+	// an affine transform keeps the packet coherent, so it is traced through the model as a whole
+	RayPacket object_packet;
+	for (uint32_t m = mask; m; m &= m - 1) {
+		int i = std::countr_zero(m);
+		object_packet.set(i, toObject(packet.ray(i)));
+		object_packet.record(i, packet.hits[i]);
+	}
+	object_packet.prepare();
+
+	model->intersect(object_packet, mask, index);
+	for (uint32_t m = mask; m; m &= m - 1) {
+		int i = std::countr_zero(m);
+		if (object_packet.tmax[i] < packet.tmax[i])
+			packet.record(i, object_packet.hits[i]);
+	}
+}
+
+bool Instance::occluded(const Ray& ray, float tmax) const
+{
+	// the object space direction keeps its length, so tmax stays in world units
+	return model->occluded(toObject(ray), tmax);
+}
+
+bool Instance::hasEmission() const
+{
+	return material ? material->hasEmission() : model->hasEmission();
+}
+
+void Instance::collectEmitters(std::vector<Emitter>& emitters, uint32_t index)
+{
+	if (!hasEmission() || !model->bvh)
+		return;
+
+	// an emissive override makes every triangle of the model a light
+	std::vector<Emitter> object_emitters;
+	if (material) {
+		const auto& triangles = model->bvh->ordered_primitives;
+		for (uint32_t i = 0; i < triangles.size(); i++) {
+			const auto* triangle = static_cast<const Triangle*>(triangles[i]);
+			object_emitters.emplace_back(triangle->v0, triangle->v1, triangle->v2, material);
+			object_emitters.back().prim_id = i;
+		}
+	} else {
+		model->collectEmitters(object_emitters, index);
+	}
+
+	for (const auto& emitter : object_emitters) {
+		emitters.emplace_back(toWorld(emitter.v0), toWorld(emitter.v1), toWorld(emitter.v2), emitter.material);
+		emitters.back().prim_id = emitter.prim_id;
+		emitters.back().instance_id = index;
+	}
+}
+
+vec3f_t Instance::evalDiffuse(const vec2f_t& texcoords) const
+{
+	if (material)
+		return material->kd;
+
+	return model->evalDiffuse(texcoords);
+}
+
+void Instance::getSurfaceProps(const vec3f_t& point, const vec3f_t& direction, uint32_t index, const vec2f_t& uv, vec3f_t& normal, vec2f_t& texcoords) const
+{
+	model->getSurfaceProps(point, direction, index, uv, normal, texcoords);
+	normal = (normal_matrix * normal).normalized();
+}
+
+Ray Instance::toObject(const Ray& ray) const
+{
+	Ray object_ray = ray;
+	object_ray.origin = inverse.block<3, 3>(0, 0) * ray.origin + inverse.block<3, 1>(0, 3);
+	object_ray.direction = inverse.block<3, 3>(0, 0) * ray.direction;
+
+	return object_ray;
+}
+
+vec3f_t Instance::toWorld(const vec3f_t& point) const
+{
+	return transform.block<3, 3>(0, 0) * point + transform.block<3, 1>(0, 3);
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include "Model.hpp"
+
+// places a shared model in the scene, rays are moved into its object space instead of copying the triangles
+struct Instance final : public Primitive {
+	Model*    model;
+	Material* material;
+
+	mat4f_t transform;
+	mat4f_t inverse;
+	mat3f_t normal_matrix;
+
+	Bound world_bound{};
+	float world_area{};
+
+	Instance(Model* model, const mat4f_t& transform = mat4f_t::Identity(), Material* material = nullptr);
+
+	auto  type() const -> PrimitiveType override;
+	Bound bound() const override;
+	float area() const override;
+	void  sample(Intersection& pos, float& pdf, Sampler& sampler) override;
+
+	bool intersect(const Ray& ray) const override;
+	bool intersect(const Ray& ray, float& tnear, uint32_t& index) const override;
+	bool intersect(const Ray& ray, HitRecord& hit, uint32_t index) const override;
+	void intersect(RayPacket& packet, uint32_t mask, uint32_t index) const override;
+	auto getIntersection(const Ray& ray, const HitRecord& hit) -> Intersection override;
+	bool occluded(const Ray& ray, float tmax) const override;
+
+	bool hasEmission() const override;
+	void collectEmitters(std::vector<Emitter>& emitters, uint32_t index) override;
+	auto evalDiffuse(const vec2f_t& texcoords) const -> vec3f_t override;
+	void getSurfaceProps(const vec3f_t& point, const vec3f_t& direction, uint32_t index, const vec2f_t& uv, vec3f_t& normal, vec2f_t& texcoords) const override;
+
+	auto toObject(const Ray& ray) const -> Ray;
+	auto toWorld(const vec3f_t& point) const -> vec3f_t;
+};
@@ -1,5 +1,72 @@
 #include "Light.hpp"
 
+namespace
+{
+// the rectangle as seen from a point, in a frame along its edges, Urena et al.'s spherical rectangle sampling
+struct SphericalRectangle {
+	vec3f_t x, y, z;
+	float   x0, y0, z0, x1, y1;
+	float   b0, b1, k;
+	float   solid_angle;
+
+	SphericalRectangle(const vec3f_t& reference, const vec3f_t& corner, const vec3f_t& ex, const vec3f_t& ey) :
+	    x(ex.normalized()),
+	    y(ey.normalized()),
+	    z(x.cross(y))
+	{
+		vec3f_t d = corner - reference;
+		x0 = d.dot(x);
+		y0 = d.dot(y);
+		z0 = d.dot(z);
+		if (z0 > 0.f) {
+			z = -z;
+			z0 = -z0;
+		}
+		x1 = x0 + ex.norm();
+		y1 = y0 + ey.norm();
+
+		// normals of the four planes through the reference and an edge, the corner angles between them give the area
+		vec3f_t n0 = vec3f_t(0, z0, -y0).normalized();
+		vec3f_t n1 = vec3f_t(-z0, 0, x1).normalized();
+		vec3f_t n2 = vec3f_t(0, -z0, y1).normalized();
+		vec3f_t n3 = vec3f_t(z0, 0, -x0).normalized();
+		float   g0 = std::acos(std::clamp(-n0.dot(n1), -1.f, 1.f));
+		float   g1 = std::acos(std::clamp(-n1.dot(n2), -1.f, 1.f));
+		float   g2 = std::acos(std::clamp(-n2.dot(n3), -1.f, 1.f));
+		float   g3 = std::acos(std::clamp(-n3.dot(n0), -1.f, 1.f));
+		b0 = n0.z();
+		b1 = n2.z();
+		k = 2.f * PI - g2 - g3;
+		solid_angle = g0 + g1 - k;
+	}
+
+	vec3f_t sample(const vec3f_t& reference, const vec2f_t& u) const
+	{
+		// the first coordinate fixes x through the area to its left, the second y through the height seen along that line
+		float au = u.x() * solid_angle + k;
+		float fu = (std::cos(au) * b0 - b1) / std::sin(au);
+		float cu = std::clamp(std::copysign(1.f / std::sqrt(fu * fu + b0 * b0), fu), -1.f, 1.f);
+		float xu = std::clamp(-cu * z0 / std::sqrt(std::max(0.f, 1.f - cu * cu)), x0, x1);
+		float d = std::sqrt(xu * xu + z0 * z0);
+		float h0 = y0 / std::sqrt(d * d + y0 * y0);
+		float h1 = y1 / std::sqrt(d * d + y1 * y1);
+		float hv = h0 + u.y() * (h1 - h0);
+		float yv = hv * hv < 1.f - 1e-6f ? hv * d / std::sqrt(1.f - hv * hv) : y1;
+
+		return reference + xu * x + yv * y + z0 * z;
+	}
+};
+
+// the same cut off as for emissive triangles, rectangles that look small are area sampled
+bool bySolidAngle(float solid_angle)
+{
+	constexpr float MIN_SOLID_ANGLE = .05f;
+	constexpr float MAX_SOLID_ANGLE = 6.22f;
+
+	return std::isfinite(solid_angle) && solid_angle >= MIN_SOLID_ANGLE && solid_angle <= MAX_SOLID_ANGLE;
+}
+};        // namespace
+
 Light::Light(vec3f_t position, vec3f_t intensity) :
     position(std::move(position)),
     intensity(std::move(intensity))
@@ -13,10 +80,50 @@ AreaLight::AreaLight(vec3f_t position, vec3f_t intensity) :
     length(100.f)
 {}
 
-vec3f_t AreaLight::samplePoint() const
+vec3f_t AreaLight::samplePoint(Sampler& sampler) const
+{
+	vec2f_t random = sampler.get2D();
+
+	return position + random.x() * u + random.y() * v;
+}
+
+vec3f_t AreaLight::samplePoint(const vec3f_t& reference, LightSampling sampling, Sampler& sampler, float& pdf) const
+{
+	pdf = 0.f;
+	if ((reference - position).dot(normal) <= 0.f)
+		return position;
+
+	if (sampling == LightSampling::SOLID_ANGLE) {
+		SphericalRectangle rectangle(reference, position, u, v);
+		if (bySolidAngle(rectangle.solid_angle)) {
+			pdf = 1.f / rectangle.solid_angle;
+			return rectangle.sample(reference, sampler.get2D());
+		}
+	}
+
+	vec3f_t point = samplePoint(sampler);
+	pdf = this->pdf(reference, LightSampling::AREA, point);
+
+	return point;
+}
+
+float AreaLight::pdf(const vec3f_t& reference, LightSampling sampling, const vec3f_t& point) const
 {
-	auto random_u = Geometry::randomFloat();
-	auto random_v = Geometry::randomFloat();
+	vec3f_t to_light = point - reference;
+	float   cos_light = -to_light.normalized().dot(normal);
+	if (cos_light <= 0.f)
+		return 0.f;
+
+	if (sampling == LightSampling::SOLID_ANGLE) {
+		SphericalRectangle rectangle(reference, position, u, v);
+		if (bySolidAngle(rectangle.solid_angle))
+			return 1.f / rectangle.solid_angle;
+	}
 
-	return position + random_u * u + random_v * v;
+	return to_light.squaredNorm() / (cos_light * area());
+}
+
+float AreaLight::area() const
+{
+	return u.cross(v).norm();
 }
@@ -1,6 +1,8 @@
 #pragma once
 
 #include "global.hpp"
+#include "Sampler.hpp"
+#include "Primitive.hpp"
 
 struct Light {
 	vec3f_t position;
@@ -10,13 +12,21 @@ struct Light {
 	virtual ~Light() = default;
 };
 
+// a rectangle emitting on the side of its normal; rays hit it as two triangles and direct lighting samples it whole
 struct AreaLight : public Light {
-	float   length;
-	vec3f_t normal;
-	vec3f_t u, v;
+	float    length;
+	vec3f_t  normal;
+	vec3f_t  u, v;
+	Material material{};        // of the triangles, emits the intensity once the scene is built
 
 	AreaLight(vec3f_t position, vec3f_t intensity);
 	~AreaLight() override = default;
 
-	vec3f_t samplePoint() const;
+	vec3f_t samplePoint(Sampler& sampler) const;
+
+	// uniform over the directions the rectangle covers from reference when sampling by solid angle, else over its area;
+	// pdfs are per unit solid angle and zero from behind
+	vec3f_t samplePoint(const vec3f_t& reference, LightSampling sampling, Sampler& sampler, float& pdf) const;
+	float   pdf(const vec3f_t& reference, LightSampling sampling, const vec3f_t& point) const;
+	float   area() const;
 };
@@ -0,0 +1,269 @@
+#include "LightTree.hpp"
+
+#include <algorithm>
+
+namespace
+{
+// cos and sin of max(theta_a - theta_b, 0), from those of the two angles
+float cosSubClamped(float sin_a, float cos_a, float sin_b, float cos_b)
+{
+	return cos_a > cos_b ? 1.f : cos_a * cos_b + sin_a * sin_b;
+}
+
+float sinSubClamped(float sin_a, float cos_a, float sin_b, float cos_b)
+{
+	return cos_a > cos_b ? 0.f : sin_a * cos_b - cos_a * sin_b;
+}
+
+float sinFromCos(float cos_theta)
+{
+	return std::sqrt(std::max(0.f, 1.f - cos_theta * cos_theta));
+}
+
+// surface area orientation heuristic, power times the solid angle the cone can reach times the bounds' area
+float splitCost(const LightBounds& bounds, const Bound& node_bound, int axis)
+{
+	float theta_o = std::acos(std::clamp(bounds.cos_theta_o, -1.f, 1.f));
+	float theta_e = std::acos(std::clamp(bounds.cos_theta_e, -1.f, 1.f));
+	float theta_w = std::min(theta_o + theta_e, PI);
+	float sin_theta_o = sinFromCos(bounds.cos_theta_o);
+	float m_omega = 2.f * PI * (1.f - bounds.cos_theta_o) +
+	                PI / 2.f * (2.f * theta_w * sin_theta_o - std::cos(theta_o - 2.f * theta_w) - 2.f * theta_o * sin_theta_o + bounds.cos_theta_o);
+
+	// long thin nodes are penalized across their length
+	vec3f_t diagonal = node_bound.diagonal();
+	float   kr = diagonal.maxCoeff() / diagonal[axis];
+
+	return bounds.power * m_omega * kr * static_cast<float>(bounds.bound.area());
+}
+};        // namespace
+
+float LightBounds::importance(const vec3f_t& reference, const vec3f_t& normal) const
+{
+	// distance clamped to the size of the bounds, so a point inside a cluster does not see it as infinitely bright
+	vec3f_t center = bound.centroid();
+	vec3f_t offset = reference - center;
+	float   radius = bound.diagonal().norm() / 2.f;
+	float   d2 = std::max(offset.squaredNorm(), radius);
+	if (offset.squaredNorm() == 0.f)
+		return power / d2;
+
+	// the smallest angle any emitting normal in the cone can make with the direction to the reference, widened by the bounds' extent
+	vec3f_t wi = offset.normalized();
+	float   cos_theta_w = axis.dot(wi);
+	float   sin_theta_w = sinFromCos(cos_theta_w);
+	float   cos_theta_b = offset.squaredNorm() < radius * radius ? -1.f : std::sqrt(std::max(0.f, 1.f - radius * radius / offset.squaredNorm()));
+	float   sin_theta_b = sinFromCos(cos_theta_b);
+	float   sin_theta_o = sinFromCos(cos_theta_o);
+	float   cos_theta_x = cosSubClamped(sin_theta_w, cos_theta_w, sin_theta_o, cos_theta_o);
+	float   sin_theta_x = sinSubClamped(sin_theta_w, cos_theta_w, sin_theta_o, cos_theta_o);
+	float   cos_theta_p = cosSubClamped(sin_theta_x, cos_theta_x, sin_theta_b, cos_theta_b);
+	if (cos_theta_p <= cos_theta_e)
+		return 0.f;
+
+	float result = power * cos_theta_p / d2;
+
+	// and the smallest angle to the receiving normal, bounds fully below the surface cannot light it
+	if (normal.squaredNorm() > 0.f) {
+		float cos_theta_i = -wi.dot(normal);
+		float sin_theta_i = sinFromCos(cos_theta_i);
+		result *= std::max(cosSubClamped(sin_theta_i, cos_theta_i, sin_theta_b, cos_theta_b), 0.f);
+	}
+
+	return result;
+}
+
+LightBounds LightBounds::merge(const LightBounds& a, const LightBounds& b)
+{
+	if (a.power <= 0.f)
+		return b;
+	if (b.power <= 0.f)
+		return a;
+
+	LightBounds res;
+	res.bound = Bound::merge(a.bound, b.bound);
+	res.power = a.power + b.power;
+	res.cos_theta_e = std::min(a.cos_theta_e, b.cos_theta_e);
+
+	// smallest cone holding both, unless one already holds the other
+	float theta_a = std::acos(std::clamp(a.cos_theta_o, -1.f, 1.f));
+	float theta_b = std::acos(std::clamp(b.cos_theta_o, -1.f, 1.f));
+	float theta_d = std::acos(std::clamp(a.axis.dot(b.axis), -1.f, 1.f));
+	if (std::min(theta_d + theta_b, PI) <= theta_a) {
+		res.axis = a.axis;
+		res.cos_theta_o = a.cos_theta_o;
+	} else if (std::min(theta_d + theta_a, PI) <= theta_b) {
+		res.axis = b.axis;
+		res.cos_theta_o = b.cos_theta_o;
+	} else {
+		float   theta_o = (theta_a + theta_d + theta_b) / 2.f;
+		vec3f_t rotation_axis = a.axis.cross(b.axis);
+		res.axis = a.axis;
+		res.cos_theta_o = -1.f;
+		if (theta_o < PI && rotation_axis.squaredNorm() > 0.f) {
+			res.axis = Eigen::AngleAxisf(theta_o - theta_a, rotation_axis.normalized()) * a.axis;
+			res.cos_theta_o = std::cos(theta_o);
+		}
+	}
+
+	return res;
+}
+
+LightTree::LightTree(const std::vector<Emitter>& emitters)
+{
+	std::vector<std::pair<int, LightBounds>> lights;
+	for (int i = 0; i < static_cast<int>(emitters.size()); i++) {
+		const Emitter& emitter = emitters[i];
+		LightBounds    bounds;
+		bounds.power = emitter.power();
+		if (!(bounds.power > 0.f))
+			continue;
+
+		// triangles and rectangles emit around their normal, other shapes in every direction
+		if (emitter.primitive) {
+			bounds.bound = emitter.primitive->bound();
+			bounds.cos_theta_o = -1.f;
+		} else {
+			bounds.bound = Bound::merge(Bound(emitter.v0, emitter.v1), emitter.v2);
+			if (emitter.light)
+				bounds.bound = Bound::merge(bounds.bound, emitter.v1 + emitter.v2 - emitter.v0);
+			bounds.axis = emitter.normal;
+		}
+		lights.emplace_back(i, bounds);
+	}
+
+	trails.assign(emitters.size(), 0);
+	if (!lights.empty())
+		build(lights, 0, static_cast<int>(lights.size()), 0, 0);
+}
+
+int LightTree::build(std::vector<std::pair<int, LightBounds>>& lights, int start, int end, uint64_t trail, int depth)
+{
+	constexpr int BUCKETS = 12;
+	constexpr int MAX_SAOH_DEPTH = 32;        // then halves by count, so the 64 bit trails cannot run out
+
+	int index = static_cast<int>(nodes.size());
+	nodes.emplace_back();
+	if (end - start == 1) {
+		nodes[index] = {lights[start].second, lights[start].first, true};
+		trails[lights[start].first] = trail;
+		return index;
+	}
+
+	Bound bound, centroid_bound;
+	for (int i = start; i < end; i++) {
+		bound = Bound::merge(bound, lights[i].second.bound);
+		centroid_bound = Bound::merge(centroid_bound, lights[i].second.bound.centroid());
+	}
+
+	// bucketed split on the centroids, cheapest over all axes
+	float min_cost = std::numeric_limits<float>::max();
+	int   min_axis = -1;
+	int   min_bucket = -1;
+	for (int axis = 0; axis < 3 && depth < MAX_SAOH_DEPTH; axis++) {
+		if (centroid_bound.pmax[axis] == centroid_bound.pmin[axis])
+			continue;
+
+		LightBounds buckets[BUCKETS];
+		for (int i = start; i < end; i++) {
+			int b = std::min(static_cast<int>(BUCKETS * centroid_bound.offset(lights[i].second.bound.centroid())[axis]), BUCKETS - 1);
+			buckets[b] = LightBounds::merge(buckets[b], lights[i].second);
+		}
+
+		for (int split = 0; split < BUCKETS - 1; split++) {
+			LightBounds below, above;
+			for (int b = 0; b <= split; b++)
+				below = LightBounds::merge(below, buckets[b]);
+			for (int b = split + 1; b < BUCKETS; b++)
+				above = LightBounds::merge(above, buckets[b]);
+
+			float cost = splitCost(below, bound, axis) + splitCost(above, bound, axis);
+			if (below.power > 0.f && above.power > 0.f && cost < min_cost) {
+				min_cost = cost;
+				min_axis = axis;
+				min_bucket = split;
+			}
+		}
+	}
+
+	int mid = (start + end) / 2;
+	if (min_axis >= 0) {
+		auto it = std::partition(lights.begin() + start, lights.begin() + end, [&](const auto& light) {
+			int b = std::min(static_cast<int>(BUCKETS * centroid_bound.offset(light.second.bound.centroid())[min_axis]), BUCKETS - 1);
+			return b <= min_bucket;
+		});
+		mid = static_cast<int>(it - lights.begin());
+	} else {
+		int axis = centroid_bound.maxextent();
+		std::nth_element(lights.begin() + start, lights.begin() + mid, lights.begin() + end, [axis](const auto& a, const auto& b) {
+			return a.second.bound.centroid()[axis] < b.second.bound.centroid()[axis];
+		});
+	}
+
+	build(lights, start, mid, trail, depth + 1);
+	int second = build(lights, mid, end, trail | (uint64_t{1} << depth), depth + 1);
+	nodes[index].bounds = LightBounds::merge(nodes[index + 1].bounds, nodes[second].bounds);
+	nodes[index].offset = second;
+
+	return index;
+}
+
+int LightTree::sample(const vec3f_t& reference, const vec3f_t& normal, float u, float& pmf) const
+{
+	pmf = 0.f;
+	if (nodes.empty() || (nodes[0].leaf && nodes[0].bounds.importance(reference, normal) <= 0.f))
+		return -1;
+
+	// one uniform number does the whole walk, stretched back over [0, 1) after every choice
+	float p = 1.f;
+	int   node = 0;
+	while (!nodes[node].leaf) {
+		float first = nodes[node + 1].bounds.importance(reference, normal);
+		float second = nodes[nodes[node].offset].bounds.importance(reference, normal);
+		if (first <= 0.f && second <= 0.f)
+			return -1;
+
+		float p_first = first / (first + second);
+		if (u < p_first) {
+			u = std::min(u / p_first, 0x1.fffffep-1f);
+			p *= p_first;
+			node = node + 1;
+		} else {
+			u = std::min((u - p_first) / (1.f - p_first), 0x1.fffffep-1f);
+			p *= 1.f - p_first;
+			node = nodes[node].offset;
+		}
+	}
+
+	pmf = p;
+	return nodes[node].offset;
+}
+
+float LightTree::pmf(const vec3f_t& reference, const vec3f_t& normal, int index) const
+{
+	if (nodes.empty() || index < 0 || index >= static_cast<int>(trails.size()))
+		return 0.f;
+	if (nodes[0].leaf && nodes[0].bounds.importance(reference, normal) <= 0.f)
+		return 0.f;
+
+	// the same walk as sample, along the emitter's trail
+	float    p = 1.f;
+	int      node = 0;
+	uint64_t trail = trails[index];
+	for (; !nodes[node].leaf; trail >>= 1) {
+		float first = nodes[node + 1].bounds.importance(reference, normal);
+		float second = nodes[nodes[node].offset].bounds.importance(reference, normal);
+		if (first <= 0.f && second <= 0.f)
+			return 0.f;
+
+		p *= (trail & 1 ? second : first) / (first + second);
+		node = trail & 1 ? nodes[node].offset : node + 1;
+	}
+
+	return nodes[node].offset == index ? p : 0.f;
+}
+
+bool LightTree::empty() const
+{
+	return nodes.empty();
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "Bound.hpp"
+#include "Primitive.hpp"
+
+// how direct lighting picks which emitter to sample
+enum class LightSelection {
+	POWER,        // by area times power alone, the same everywhere
+	TREE          // by an estimate of what each would contribute at the shading point
+};
+
+// spatial, directional and power bounds of a group of emitters
+struct LightBounds {
+	Bound   bound{};
+	vec3f_t axis{0, 0, 1};        // emitting normals lie within theta_o of the axis
+	float   cos_theta_o{1};
+	float   cos_theta_e{0};        // and light leaves a surface at most theta_e off its normal
+	float   power{};
+
+	auto importance(const vec3f_t& reference, const vec3f_t& normal) const -> float;
+
+	static LightBounds merge(const LightBounds& a, const LightBounds& b);
+};
+
+// binary tree over the emitters, walked down per shading point choosing the child that is likely to light it more;
+// Conty Estevez and Kulla's many-light sampling with the orientation aware split cost of pbrt-v4
+class LightTree {
+public:
+	LightTree() = default;
+	explicit LightTree(const std::vector<Emitter>& emitters);
+
+	auto sample(const vec3f_t& reference, const vec3f_t& normal, float u, float& pmf) const -> int;
+	auto pmf(const vec3f_t& reference, const vec3f_t& normal, int index) const -> float;
+	bool empty() const;
+
+private:
+	// depth-first, the first child directly follows its parent
+	struct Node {
+		LightBounds bounds;
+		int         offset{};        // emitter index for a leaf, second child for an interior node
+		bool        leaf{};
+	};
+
+	std::vector<Node>     nodes;
+	std::vector<uint64_t> trails;        // per emitter, bit d set where its path takes the second child at depth d
+
+	auto build(std::vector<std::pair<int, LightBounds>>& lights, int start, int end, uint64_t trail, int depth) -> int;
+};
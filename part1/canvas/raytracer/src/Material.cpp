@@ -1,5 +1,23 @@
 #include "Material.hpp"
 
+namespace
+{
+float ggxDistribution(float cos_h, float alpha)
+{
+	float a2 = alpha * alpha;
+	float d = cos_h * cos_h * (a2 - 1.f) + 1.f;
+
+	return a2 / (PI * d * d);
+}
+
+float smithMasking(float cos_v, float alpha)
+{
+	float a2 = alpha * alpha;
+
+	return 2.f * cos_v / (cos_v + std::sqrt(a2 + (1.f - a2) * cos_v * cos_v));
+}
+};        // namespace
+
 bool Material::hasEmission() const
 {
 	return emission.norm() > 1e-6f;
@@ -62,25 +80,88 @@ vec3f_t Material::toWorld(const vec3f_t& local, const vec3f_t& normal) const
 	return local.x() * a + local.y() * b + local.z() * normal;
 }
 
-vec3f_t Material::sample(const vec3f_t& wi, const vec3f_t& normal)
+vec3f_t Material::sample(const vec3f_t& wi, const vec3f_t& normal, Sampler& sampler)
 {
-	float x1 = Geometry::randomFloat();
-	float x2 = Geometry::randomFloat();
-	float z = std::fabs(1.f - 2.f * x1);
-	float r = std::sqrt(1.f - z * z);
-	float phi = 2.f * PI * x2;
+	vec2f_t u = sampler.get2D();
+	float   p_specular = specularProbability();
+
+	// the first coordinate picks the lobe and is then stretched back over [0, 1)
+	if (u.x() < p_specular) {
+		u.x() = std::min(u.x() / p_specular, 0x1.fffffep-1f);
+
+		// GGX half vector, reflected about to give the outgoing direction
+		float   alpha = roughness();
+		float   cos2_theta = (1.f - u.x()) / (1.f + (alpha * alpha - 1.f) * u.x());
+		float   cos_theta = std::sqrt(cos2_theta);
+		float   sin_theta = std::sqrt(std::max(0.f, 1.f - cos2_theta));
+		float   phi = 2.f * PI * u.y();
+		vec3f_t half = toWorld(vec3f_t(sin_theta * std::cos(phi), sin_theta * std::sin(phi), cos_theta), normal);
+
+		return wi - 2.f * wi.dot(half) * half;
+	}
+
+	u.x() = std::min((u.x() - p_specular) / (1.f - p_specular), 0x1.fffffep-1f);
 
-	vec3f_t local(r * std::cos(phi), r * std::sin(phi), z);
+	// cosine weighted hemisphere, a uniform disk projected up
+	float r = std::sqrt(u.x());
+	float phi = 2.f * PI * u.y();
+	float z = std::sqrt(std::max(0.f, 1.f - u.x()));
 
-	return toWorld(local, normal);
+	return toWorld(vec3f_t(r * std::cos(phi), r * std::sin(phi), z), normal);
 }
 
 vec3f_t Material::eval(const vec3f_t& wi, const vec3f_t& wo, const vec3f_t& normal) const
 {
-	return normal.dot(wo) > .0f ? kd / PI : vec3f_t{};
+	float cos_o = normal.dot(wo);
+	float cos_i = -normal.dot(wi);
+	if (cos_o <= 0.f)
+		return vec3f_t(0, 0, 0);
+
+	vec3f_t f = kd / PI;
+	if (specularProbability() > 0.f && cos_i > 0.f) {
+		vec3f_t half = (wo - wi).normalized();
+		float   alpha = roughness();
+		float   cos_h = half.dot(normal);
+
+		// Walter et al. microfacet model, Schlick's fresnel with ks as the reflectance at normal incidence
+		float   d = ggxDistribution(cos_h, alpha);
+		float   g = smithMasking(cos_i, alpha) * smithMasking(cos_o, alpha);
+		vec3f_t fresnel = ks + (vec3f_t::Ones() - ks) * std::pow(1.f - std::clamp(wo.dot(half), 0.f, 1.f), 5.f);
+		f += fresnel * d * g / (4.f * cos_i * cos_o);
+	}
+
+	return f;
 }
 
 float Material::pdf(const vec3f_t& wi, const vec3f_t& wo, const vec3f_t& normal) const
 {
-	return normal.dot(wo) > 0.f ? .5f / PI : 0.f;
+	float cos_o = normal.dot(wo);
+	if (cos_o <= 0.f)
+		return 0.f;
+
+	float p_specular = specularProbability();
+	float pdf = (1.f - p_specular) * cos_o / PI;
+	if (p_specular > 0.f) {
+		vec3f_t half = (wo - wi).normalized();
+		float   cos_h = half.dot(normal);
+		float   wo_dot_h = std::fabs(wo.dot(half));
+		if (cos_h > 0.f && wo_dot_h > 0.f)
+			pdf += p_specular * ggxDistribution(cos_h, roughness()) * cos_h / (4.f * wo_dot_h);
+	}
+
+	return pdf;
+}
+
+float Material::roughness() const
+{
+	// GGX width matching the phong exponent of the material file
+	return std::clamp(std::sqrt(2.f / (specular_exponent + 2.f)), 1e-3f, 1.f);
+}
+
+float Material::specularProbability() const
+{
+	float diffuse = Geometry::luminance(kd);
+	float specular = Geometry::luminance(ks);
+
+	return specular > 0.f ? specular / (diffuse + specular) : 0.f;
 }
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "global.hpp"
+#include "Sampler.hpp"
 
 struct Material {
 	vec3f_t kd;
@@ -16,7 +17,10 @@ struct Material {
 	float   fresnel(const vec3f_t& normal, const vec3f_t& incident, float ior);
 	vec3f_t toWorld(const vec3f_t& local, const vec3f_t& normal) const;
 
-	vec3f_t sample(const vec3f_t& wi, const vec3f_t& normal);
+	// a lambertian lobe plus a GGX reflection lobe weighted by ks, sample and pdf pick between them by their albedo
+	vec3f_t sample(const vec3f_t& wi, const vec3f_t& normal, Sampler& sampler);
 	vec3f_t eval(const vec3f_t& wi, const vec3f_t& wo, const vec3f_t& normal) const;
 	float   pdf(const vec3f_t& wi, const vec3f_t& wo, const vec3f_t& normal) const;
+	float   roughness() const;
+	float   specularProbability() const;
 };
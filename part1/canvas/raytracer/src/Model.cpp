@@ -4,6 +4,7 @@
 #include "Model.hpp"
 
 #include <iostream>
+#include <bit>
 
 Texture::Texture(const std::string& file_path, TextureType type)
 {
@@ -38,7 +39,7 @@ vec3f_t Texture::sample(float u, float v) const
 	return data[index % data.size()];
 }
 
-Model::Model(const std::string& filepath, Material* mat)
+Model::Model(const std::string& filepath, Material* mat, int max_primitives_per_leaf, BVHLayout layout)
 {
 	// get file directory and name
 	size_t      file_pos = filepath.find_last_of('/');
@@ -175,7 +176,7 @@ Model::Model(const std::string& filepath, Material* mat)
 		bounding_box = Bound::merge(bounding_box, triangle.bound());
 
 	// build BVH
-	bvh = new BVHAccel(primitives);
+	bvh = new BVHAccel(primitives, max_primitives_per_leaf, BVHBuildMethod::SAH, 0, layout);
 }
 
 Model::~Model()
@@ -184,6 +185,11 @@ Model::~Model()
 	bvh = nullptr;
 }
 
+PrimitiveType Model::type() const
+{
+	return PrimitiveType::MODEL;
+}
+
 Bound Model::bound() const
 {
 	return bounding_box;
@@ -194,11 +200,11 @@ float Model::area() const
 	return total_area;
 }
 
-void Model::sample(Intersection& pos, float& pdf)
+void Model::sample(Intersection& pos, float& pdf, Sampler& sampler)
 {
 	if (bvh) {
-		bvh->sample(pos, pdf);
-		pos.emit = pos.material->emission;
+		bvh->sample(pos, pdf, sampler);
+		pos.emit = pos.material ? pos.material->emission : vec3f_t::Zero();
 	}
 }
 
@@ -224,13 +230,39 @@ bool Model::intersect(const Ray& ray, float& tnear, uint32_t& index) const
 	return intersected;
 }
 
-Intersection Model::getIntersection(const Ray& ray)
+bool Model::intersect(const Ray& ray, HitRecord& hit, uint32_t index) const
 {
-	Intersection intersection;
-	if (bvh)
-		intersection = bvh->intersect(ray);
+	// the triangle keeps the index the model's BVH gave it, the model adds its own
+	if (!bvh || !bvh->intersect(ray, hit))
+		return false;
 
-	return intersection;
+	hit.instance_id = index;
+	return true;
+}
+
+void Model::intersect(RayPacket& packet, uint32_t mask, uint32_t index) const
+{
+	if (!bvh)
+		return;
+
+	float tmax[RayPacket::SIZE];
+	std::copy(std::begin(packet.tmax), std::end(packet.tmax), tmax);
+	bvh->intersect(packet, mask);
+	for (; mask; mask &= mask - 1) {
+		int i = std::countr_zero(mask);
+		if (packet.tmax[i] < tmax[i])
+			packet.hits[i].instance_id = index;
+	}
+}
+
+Intersection Model::getIntersection(const Ray& ray, const HitRecord& hit)
+{
+	return bvh->ordered_primitives[hit.prim_id]->getIntersection(ray, hit);
+}
+
+bool Model::occluded(const Ray& ray, float tmax) const
+{
+	return bvh && bvh->occluded(ray, tmax);
 }
 
 bool Model::hasEmission() const
@@ -238,6 +270,19 @@ bool Model::hasEmission() const
 	return has_emission;
 }
 
+void Model::collectEmitters(std::vector<Emitter>& emitters, uint32_t index)
+{
+	if (!has_emission || !bvh)
+		return;
+
+	// in BVH order, the order hit records number the triangles in
+	size_t first = emitters.size();
+	for (uint32_t i = 0; i < bvh->ordered_primitives.size(); i++)
+		bvh->ordered_primitives[i]->collectEmitters(emitters, i);
+	for (size_t i = first; i < emitters.size(); i++)
+		emitters[i].instance_id = index;
+}
+
 vec3f_t Model::evalDiffuse(const vec2f_t& tx) const
 {
 	float scale = 5;
@@ -28,7 +28,7 @@ struct Texture {
 	vec3f_t sample(float u, float v) const;
 };
 
-struct Model : public Primitive {
+struct Model final : public Primitive {
 	std::vector<Triangle> triangles;
 	std::vector<Material> materials;
 
@@ -41,18 +41,23 @@ struct Model : public Primitive {
 	float total_area{};
 	Bound bounding_box{};
 
-	Model(const std::string& filepath, Material* material = nullptr);
+	Model(const std::string& filepath, Material* material = nullptr, int max_primitives_per_leaf = 4, BVHLayout layout = BVHLayout::BINARY);
 	~Model() override;
 
+	auto  type() const -> PrimitiveType override;
 	Bound bound() const override;
 	float area() const override;
-	void  sample(Intersection& pos, float& pdf) override;
+	void  sample(Intersection& pos, float& pdf, Sampler& sampler) override;
 
 	bool intersect(const Ray& ray) const override;
 	bool intersect(const Ray& ray, float& tnear, uint32_t& index) const override;
-	auto getIntersection(const Ray& ray) -> Intersection override;
+	bool intersect(const Ray& ray, HitRecord& hit, uint32_t index) const override;
+	void intersect(RayPacket& packet, uint32_t mask, uint32_t index) const override;
+	auto getIntersection(const Ray& ray, const HitRecord& hit) -> Intersection override;
+	bool occluded(const Ray& ray, float tmax) const override;
 
 	bool hasEmission() const override;
+	void collectEmitters(std::vector<Emitter>& emitters, uint32_t index) override;
 	auto evalDiffuse(const vec2f_t& texcoords) const -> vec3f_t override;
 	void getSurfaceProps(const vec3f_t& point, const vec3f_t& direction, uint32_t index, const vec2f_t& uv, vec3f_t& normal, vec2f_t& texcoords) const override;
 };
@@ -1,4 +1,39 @@
 #include "Primitive.hpp"
+#include "Light.hpp"
+
+#include <bit>
+
+namespace
+{
+// under a twentieth of a steradian distance and cosine vary by a few percent across a triangle, so area sampling is already
+// close to uniform in solid angle and cheaper; nearly hemispherical ones are numerically shaky as spherical triangles
+bool bySolidAngle(float solid_angle)
+{
+	constexpr float MIN_SOLID_ANGLE = .05f;
+	constexpr float MAX_SOLID_ANGLE = 6.22f;
+
+	return solid_angle >= MIN_SOLID_ANGLE && solid_angle <= MAX_SOLID_ANGLE;
+}
+};        // namespace
+
+void Primitive::intersect(RayPacket& packet, uint32_t mask, uint32_t index) const
+{
+	// one ray at a time unless the primitive knows something better
+	for (; mask; mask &= mask - 1) {
+		int       i = std::countr_zero(mask);
+		HitRecord hit = packet.hits[i];
+		if (intersect(packet.ray(i), hit, index))
+			packet.record(i, hit);
+	}
+}
+
+void Primitive::collectEmitters(std::vector<Emitter>& emitters, uint32_t index)
+{
+	if (hasEmission()) {
+		emitters.emplace_back(this, area());
+		emitters.back().prim_id = index;
+	}
+}
 
 bool Triangle::intersect(const vec3f_t& v0, const vec3f_t& v1, const vec3f_t& v2,
                          const vec3f_t& origin, const vec3f_t& direction,
@@ -29,6 +64,11 @@ bool Triangle::intersect(const vec3f_t& v0, const vec3f_t& v1, const vec3f_t& v2
 	return true;
 }
 
+PrimitiveType Triangle::type() const
+{
+	return PrimitiveType::TRIANGLE;
+}
+
 Bound Triangle::bound() const
 {
 	return Bound{
@@ -41,10 +81,11 @@ float Triangle::area() const
 	return 0.5f * (v1 - v0).cross(v2 - v0).norm();
 }
 
-void Triangle::sample(Intersection& pos, float& pdf)
+void Triangle::sample(Intersection& pos, float& pdf, Sampler& sampler)
 {
-	float r1 = Geometry::randomFloat();
-	float r2 = Geometry::randomFloat();
+	vec2f_t random = sampler.get2D();
+	float   r1 = random.x();
+	float   r2 = random.y();
 	if (r1 + r2 > 1.0f) {
 		r1 = 1.0f - r1;
 		r2 = 1.0f - r2;
@@ -71,43 +112,70 @@ bool Triangle::intersect(const Ray& ray, float& tnear, uint32_t& index) const
 	return false;
 }
 
-Intersection Triangle::getIntersection(const Ray& ray)
+bool Triangle::intersect(const Ray& ray, HitRecord& hit, uint32_t index) const
 {
-	Intersection intersection;
-
 	vec3f_t e1 = v1 - v0, e2 = v2 - v0;
 	vec3f_t normal = e1.cross(e2).normalized();
 	if (ray.direction.dot(normal) > 0.f)
-		return intersection;
+		return false;
 
 	float   u, v, tnear{};
 	vec3f_t pvec = ray.direction.cross(e2);
 	float   det = e1.dot(pvec);
 	if (std::fabs(det) < 1e-8f)
-		return intersection;
+		return false;
 
 	float   inv_det = 1.0f / det;
 	vec3f_t tvec = ray.origin - v0;
 	u = tvec.dot(pvec) * inv_det;
 	if (u < 0 || u > 1)
-		return intersection;
+		return false;
 
 	vec3f_t qvec = tvec.cross(e1);
 	v = ray.direction.dot(qvec) * inv_det;
 	if (v < 0 || u + v > 1)
-		return intersection;
+		return false;
 
 	tnear = e2.dot(qvec) * inv_det;
-	if (tnear < 0)
-		return intersection;
+	if (tnear < 0 || tnear >= hit.t)
+		return false;
 
+	hit = HitRecord{tnear, index, HitRecord::INVALID, u, v};
+	return true;
+}
+
+bool Triangle::occluded(const Ray& ray, float tmax) const
+{
+	// the same back face culling as intersect, so shadows agree with what camera rays see
+	vec3f_t e1 = v1 - v0, e2 = v2 - v0;
+	vec3f_t pvec = ray.direction.cross(e2);
+	float   det = e1.dot(pvec);
+	if (det < 1e-8f)
+		return false;
+
+	vec3f_t tvec = ray.origin - v0;
+	float   u = tvec.dot(pvec);
+	if (u < 0 || u > det)
+		return false;
+
+	vec3f_t qvec = tvec.cross(e1);
+	float   v = ray.direction.dot(qvec);
+	if (v < 0 || u + v > det)
+		return false;
+
+	float tnear = e2.dot(qvec) / det;
+	return tnear >= 0 && tnear < tmax;
+}
+
+Intersection Triangle::getIntersection(const Ray& ray, const HitRecord& hit)
+{
+	Intersection intersection;
 	intersection.hit = true;
-	intersection.position = ray.at(tnear);
-	intersection.distance = tnear;
-	intersection.texcoord = vec2f_t(u, v);
-	intersection.normal = normal;
-	intersection.material = this->material;
+	intersection.position = ray.at(hit.t);
+	intersection.distance = hit.t;
+	intersection.material = material;
 	intersection.primitive = this;
+	getSurfaceProps(intersection.position, ray.direction, hit.prim_id, vec2f_t(hit.u, hit.v), intersection.normal, intersection.texcoord);
 
 	return intersection;
 }
@@ -117,6 +185,14 @@ bool Triangle::hasEmission() const
 	return material && material->hasEmission();
 }
 
+void Triangle::collectEmitters(std::vector<Emitter>& emitters, uint32_t index)
+{
+	if (hasEmission()) {
+		emitters.emplace_back(v0, v1, v2, material);
+		emitters.back().prim_id = index;
+	}
+}
+
 vec3f_t Triangle::evalDiffuse(const vec2f_t& texcoords) const
 {
 	if (material)
@@ -132,6 +208,11 @@ void Triangle::getSurfaceProps(const vec3f_t& point, const vec3f_t& direction, u
 	texcoords = w * t0 + uv.x() * t1 + uv.y() * t2;
 }
 
+PrimitiveType Sphere::type() const
+{
+	return PrimitiveType::SPHERE;
+}
+
 Bound Sphere::bound() const
 {
 	return Bound{
@@ -144,10 +225,11 @@ float Sphere::area() const
 	return 4.0f * PI * radius * radius;
 }
 
-void Sphere::sample(Intersection& pos, float& pdf)
+void Sphere::sample(Intersection& pos, float& pdf, Sampler& sampler)
 {
-	float u1 = Geometry::randomFloat() * 2.0f * PI;
-	float u2 = Geometry::randomFloat() * PI;
+	vec2f_t random = sampler.get2D();
+	float   u1 = random.x() * 2.0f * PI;
+	float   u2 = random.y() * PI;
 	float z = 1.f - 2.f * u1;
 	float r = std::sqrt(std::max(0.f, 1.f - z * z));
 	float phi = 2.f * PI * u2;
@@ -205,37 +287,76 @@ bool Sphere::intersect(const Ray& ray, float& tnear, uint32_t& index) const
 	return true;
 }
 
-Intersection Sphere::getIntersection(const Ray& ray)
+bool Sphere::intersect(const Ray& ray, HitRecord& hit, uint32_t index) const
+{
+	float    tnear;
+	uint32_t unused;
+	if (!intersect(ray, tnear, unused) || tnear >= hit.t)
+		return false;
+
+	hit = HitRecord{tnear, index, HitRecord::INVALID, 0, 0};
+	return true;
+}
+
+void Sphere::intersect(RayPacket& packet, uint32_t mask, uint32_t index) const
+{
+	// solves each lane's quadratic straight from the packet's columns, no ray or hit record is built per lane
+	for (; mask; mask &= mask - 1) {
+		int   i = std::countr_zero(mask);
+		float a = 0, b = 0, c = -radius * radius;
+		for (int axis = 0; axis < 3; axis++) {
+			float l = packet.origin[axis][i] - center[axis];
+			float d = packet.direction[axis][i];
+			a += d * d;
+			b += 2 * d * l;
+			c += l * l;
+		}
+
+		float t0, t1;
+		if (!Geometry::solveQuadratic(a, b, c, t0, t1))
+			continue;
+		if (t0 < 0.f)
+			t0 = t1;
+		if (t0 >= 0.f && t0 < packet.tmax[i])
+			packet.record(i, HitRecord{t0, index, HitRecord::INVALID, 0, 0});
+	}
+}
+
+Intersection Sphere::getIntersection(const Ray& ray, const HitRecord& hit)
 {
 	Intersection intersection;
-	float        tnear;
-	uint32_t     index;
-	vec3f_t      local_point = (intersection.position - center) / radius;
-	float        phi = std::atan2(local_point.z(), local_point.x());
-	float        theta = std::acos(std::clamp(local_point.y(), -1.f, 1.f));
-	float        u = (phi + PI) / (2.f * PI);
-	float        v = theta / PI;
-
-	intersection.hit = intersect(ray, tnear, index);
-	if (!intersection.hit)
-		return intersection;
-
-	intersection.position = ray.origin + ray.direction * tnear;
-	intersection.normal = (intersection.position - center).normalized();
-	intersection.material = this->material;
+	intersection.hit = true;
+	intersection.position = ray.at(hit.t);
+	intersection.distance = hit.t;
+	intersection.material = material;
 	intersection.primitive = this;
-	intersection.distance = tnear;
-	intersection.texcoord = vec2f_t(u, v);
 	intersection.emit = vec3f_t(0, 0, 0);
+	getSurfaceProps(intersection.position, ray.direction, hit.prim_id, vec2f_t(hit.u, hit.v), intersection.normal, intersection.texcoord);
 
 	return intersection;
 }
 
+bool Sphere::occluded(const Ray& ray, float tmax) const
+{
+	float    tnear;
+	uint32_t index;
+
+	return intersect(ray, tnear, index) && tnear < tmax;
+}
+
 bool Sphere::hasEmission() const
 {
 	return material && material->hasEmission();
 }
 
+void Sphere::collectEmitters(std::vector<Emitter>& emitters, uint32_t index)
+{
+	if (hasEmission()) {
+		emitters.emplace_back(this, area(), material);
+		emitters.back().prim_id = index;
+	}
+}
+
 vec3f_t Sphere::evalDiffuse(const vec2f_t& texcoords) const
 {
 	if (material)
@@ -253,3 +374,116 @@ void Sphere::getSurfaceProps(const vec3f_t& point, const vec3f_t& direction, uin
 	texcoords.x() = (phi + PI) / (2.f * PI);
 	texcoords.y() = theta / PI;
 }
+
+Emitter::Emitter(Primitive* primitive, float area, Material* material) :
+    primitive(primitive),
+    material(material),
+    area(area)
+{}
+
+Emitter::Emitter(const vec3f_t& v0, const vec3f_t& v1, const vec3f_t& v2, Material* material) :
+    v0(v0),
+    v1(v1),
+    v2(v2),
+    normal((v1 - v0).cross(v2 - v0).normalized()),
+    material(material),
+    area(0.5f * (v1 - v0).cross(v2 - v0).norm())
+{}
+
+Emitter::Emitter(AreaLight* light) :
+    light(light),
+    v0(light->position),
+    v1(light->position + light->u),
+    v2(light->position + light->v),
+    normal(light->normal),
+    material(&light->material),
+    area(light->area())
+{}
+
+float Emitter::power() const
+{
+	// luminance of the emission times area, the flux up to a constant; without a material every emitter counts the same per area
+	vec3f_t emission = material ? material->emission : vec3f_t::Ones();
+
+	return area * Geometry::luminance(emission);
+}
+
+void Emitter::sample(const vec3f_t& reference, LightSampling sampling, Intersection& pos, float& pdf, Sampler& sampler) const
+{
+	pdf = 0.f;
+	if (primitive) {
+		float area_pdf;
+		primitive->sample(pos, area_pdf, sampler);
+		vec3f_t to_light = pos.position - reference;
+		float   cos_light = -to_light.normalized().dot(pos.normal);
+		if (cos_light > 0.f)
+			pdf = area_pdf * to_light.squaredNorm() / cos_light;
+		return;
+	}
+
+	pos.hit = true;
+	pos.normal = normal;
+	pos.material = material;
+	pos.emit = material ? material->emission : vec3f_t(0, 0, 0);
+	if (light) {
+		pos.position = light->samplePoint(reference, sampling, sampler, pdf);
+		return;
+	}
+
+	vec2f_t random = sampler.get2D();
+	if ((reference - v0).dot(normal) <= 0.f)
+		return;
+
+	// uniform over the directions the triangle covers, then back onto its plane
+	if (sampling == LightSampling::SOLID_ANGLE) {
+		vec3f_t a = (v0 - reference).normalized();
+		vec3f_t b = (v1 - reference).normalized();
+		vec3f_t c = (v2 - reference).normalized();
+		float   solid_angle = Geometry::sphericalTriangleArea(a, b, c);
+		if (bySolidAngle(solid_angle)) {
+			vec3f_t direction = Geometry::sampleSphericalTriangle(a, b, c, solid_angle, random);
+			float   t = (v0 - reference).dot(normal) / direction.dot(normal);
+			if (!(t > 0.f))
+				return;
+
+			pos.position = reference + t * direction;
+			float b1 = (pos.position - v0).cross(v2 - v0).norm() * 0.5f / area;
+			float b2 = (v1 - v0).cross(pos.position - v0).norm() * 0.5f / area;
+			pos.texcoord = vec2f_t(b1, b2);
+			pdf = 1.f / solid_angle;
+			return;
+		}
+	}
+
+	float r1 = random.x();
+	float r2 = random.y();
+	if (r1 + r2 > 1.0f) {
+		r1 = 1.0f - r1;
+		r2 = 1.0f - r2;
+	}
+	float r3 = 1.0f - r1 - r2;
+
+	pos.position = r3 * v0 + r1 * v1 + r2 * v2;
+	pos.texcoord = vec2f_t(r1, r2);
+	vec3f_t to_light = pos.position - reference;
+	pdf = to_light.squaredNorm() / (-to_light.normalized().dot(normal) * area);
+}
+
+float Emitter::pdf(const vec3f_t& reference, LightSampling sampling, const Intersection& pos) const
+{
+	if (light)
+		return light->pdf(reference, sampling, pos.position);
+
+	vec3f_t to_light = pos.position - reference;
+	float   cos_light = -to_light.normalized().dot(primitive ? pos.normal : normal);
+	if (cos_light <= 0.f)
+		return 0.f;
+
+	if (sampling == LightSampling::SOLID_ANGLE && !primitive) {
+		float solid_angle = Geometry::sphericalTriangleArea((v0 - reference).normalized(), (v1 - reference).normalized(), (v2 - reference).normalized());
+		if (bySolidAngle(solid_angle))
+			return 1.f / solid_angle;
+	}
+
+	return to_light.squaredNorm() / (cos_light * area);
+}
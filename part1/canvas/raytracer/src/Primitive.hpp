@@ -4,38 +4,58 @@
 #include "Bound.hpp"
 #include "Material.hpp"
 
+struct Emitter;
+struct AreaLight;
+
+// the closed set of primitive kinds, BVH leaves hold one kind each and call its code directly
+enum class PrimitiveType : uint8_t {
+	TRIANGLE,
+	SPHERE,
+	MODEL,
+	INSTANCE
+};
+
 struct Primitive {
 	virtual ~Primitive() = default;
 
+	virtual auto  type() const -> PrimitiveType = 0;
 	virtual Bound bound() const = 0;
 	virtual float area() const = 0;
-	virtual void  sample(Intersection& pos, float& pdf) = 0;
+	virtual void  sample(Intersection& pos, float& pdf, Sampler& sampler) = 0;
 
 	virtual bool intersect(const Ray& ray) const = 0;
 	virtual bool intersect(const Ray& ray, float& tnear, uint32_t& index) const = 0;
-	virtual auto getIntersection(const Ray& ray) -> Intersection = 0;
+	virtual bool intersect(const Ray& ray, HitRecord& hit, uint32_t index) const = 0;        // a hit nearer than hit.t is recorded under index
+	virtual void intersect(RayPacket& packet, uint32_t mask, uint32_t index) const;
+	virtual auto getIntersection(const Ray& ray, const HitRecord& hit) -> Intersection = 0;
+	virtual bool occluded(const Ray& ray, float tmax) const = 0;        // any hit in [0, tmax), no shading data
 
 	virtual bool hasEmission() const = 0;
+	virtual void collectEmitters(std::vector<Emitter>& emitters, uint32_t index);        // index as passed to intersect, so an emitter knows the hit records landing on it
 	virtual auto evalDiffuse(const vec2f_t& texcoords) const -> vec3f_t = 0;
 	virtual void getSurfaceProps(const vec3f_t& point, const vec3f_t& direction, uint32_t index, const vec2f_t& uv, vec3f_t& normal, vec2f_t& texcoords) const = 0;
 };
 
-struct Triangle : public Primitive {
+struct Triangle final : public Primitive {
 	vec3f_t   v0, v1, v2;
 	vec3f_t   n0, n1, n2;
 	vec2f_t   t0, t1, t2;
 	float     sarea;
 	Material* material;
 
+	auto  type() const -> PrimitiveType override;
 	Bound bound() const override;
 	float area() const override;
-	void  sample(Intersection& pos, float& pdf) override;
+	void  sample(Intersection& pos, float& pdf, Sampler& sampler) override;
 
 	bool intersect(const Ray& ray) const override;
 	bool intersect(const Ray& ray, float& tnear, uint32_t& index) const override;
-	auto getIntersection(const Ray& ray) -> Intersection override;
+	bool intersect(const Ray& ray, HitRecord& hit, uint32_t index) const override;
+	auto getIntersection(const Ray& ray, const HitRecord& hit) -> Intersection override;
+	bool occluded(const Ray& ray, float tmax) const override;
 
 	bool hasEmission() const override;
+	void collectEmitters(std::vector<Emitter>& emitters, uint32_t index) override;
 	auto evalDiffuse(const vec2f_t& texcoords) const -> vec3f_t override;
 	void getSurfaceProps(const vec3f_t& point, const vec3f_t& direction, uint32_t index, const vec2f_t& uv, vec3f_t& normal, vec2f_t& texcoords) const override;
 
@@ -44,21 +64,54 @@ struct Triangle : public Primitive {
 	                      float& tnear, float& u, float& v);
 };
 
-struct Sphere : public Primitive {
+struct Sphere final : public Primitive {
 	vec3f_t center;
 	float   radius;
 
 	Material* material;
 
+	auto  type() const -> PrimitiveType override;
 	Bound bound() const override;
 	float area() const override;
-	void  sample(Intersection& pos, float& pdf) override;
+	void  sample(Intersection& pos, float& pdf, Sampler& sampler) override;
 
 	bool intersect(const Ray& ray) const override;
 	bool intersect(const Ray& ray, float& tnear, uint32_t& index) const override;
-	auto getIntersection(const Ray& ray) -> Intersection override;
+	bool intersect(const Ray& ray, HitRecord& hit, uint32_t index) const override;
+	void intersect(RayPacket& packet, uint32_t mask, uint32_t index) const override;
+	auto getIntersection(const Ray& ray, const HitRecord& hit) -> Intersection override;
+	bool occluded(const Ray& ray, float tmax) const override;
 
 	bool hasEmission() const override;
+	void collectEmitters(std::vector<Emitter>& emitters, uint32_t index) override;
 	auto evalDiffuse(const vec2f_t& texcoords) const -> vec3f_t override;
 	void getSurfaceProps(const vec3f_t& point, const vec3f_t& direction, uint32_t index, const vec2f_t& uv, vec3f_t& normal, vec2f_t& texcoords) const override;
 };
+
+// how direct lighting picks a point on an emitter
+enum class LightSampling {
+	AREA,              // uniform over its surface
+	SOLID_ANGLE        // uniform over the directions it covers from the shading point, triangles that look too small or too large fall back to area
+};
+
+// emissive surface as seen by direct lighting, triangles are listed one by one in world space
+struct Emitter {
+	Primitive* primitive{};        // sampled through the primitive when it is not a triangle
+	AreaLight* light{};            // or through an area light, v0, v1 and v2 are then corners of its rectangle
+	vec3f_t    v0, v1, v2;
+	vec3f_t    normal;                 // of the emitting side, triangles and rectangles only
+	Material*  material{};
+	float      area{};
+	uint32_t   prim_id{HitRecord::INVALID};        // ids in the hit record of a ray landing on it
+	uint32_t   instance_id{HitRecord::INVALID};
+
+	Emitter(Primitive* primitive, float area, Material* material = nullptr);
+	Emitter(const vec3f_t& v0, const vec3f_t& v1, const vec3f_t& v2, Material* material);
+	explicit Emitter(AreaLight* light);
+
+	auto power() const -> float;
+
+	// pdfs are per unit solid angle as seen from reference, zero from behind the emitting side
+	void sample(const vec3f_t& reference, LightSampling sampling, Intersection& pos, float& pdf, Sampler& sampler) const;
+	auto pdf(const vec3f_t& reference, LightSampling sampling, const Intersection& pos) const -> float;
+};
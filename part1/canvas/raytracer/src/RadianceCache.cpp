@@ -0,0 +1,159 @@
+#include "RadianceCache.hpp"
+
+#include <atomic>
+#include <bit>
+
+namespace
+{
+constexpr int      COUNTERS = 16;
+constexpr int      COORDINATE_BITS = 20;
+constexpr uint64_t USED = 1ull << 63;        // set in every claimed key, so no cell's key is 0
+
+// murmur3's finalizer, neighbouring cells land far apart in the table
+uint64_t mix(uint64_t key)
+{
+	key ^= key >> 33;
+	key *= 0xff51afd7ed558ccdull;
+	key ^= key >> 33;
+	key *= 0xc4ceb9fe1a85ec53ull;
+	key ^= key >> 33;
+
+	return key;
+}
+
+// atomic read of a value other threads may be adding to, from a const method
+template <typename T>
+T load(const T& value, std::memory_order order = std::memory_order_relaxed)
+{
+	return std::atomic_ref<T>(const_cast<T&>(value)).load(order);
+}
+};        // namespace
+
+void RadianceCache::reset(const Bound& scene_bound, int resolution, int capacity)
+{
+	float cell_size = scene_bound.diagonal().maxCoeff() / std::max(resolution, 1);
+	origin = scene_bound.pmin;
+	inverse_cell_size = cell_size > 0.f ? 1.f / cell_size : 0.f;
+	table.assign(std::bit_ceil(static_cast<uint32_t>(std::max(capacity, 1))), Cell{});
+	counters.assign(COUNTERS, Counter{});
+}
+
+bool RadianceCache::lookup(const vec3f_t& position, const vec3f_t& normal, vec3f_t& radiance) const
+{
+	constexpr uint32_t MIN_SAMPLES = 4;        // fewer records leave a cell too noisy to end paths at
+
+	if (table.empty())
+		return false;
+
+	uint64_t cell_key = key(position, normal);
+	Counter& counter = counters[mix(cell_key) % COUNTERS];
+	std::atomic_ref<uint64_t>(counter.lookups).fetch_add(1, std::memory_order_relaxed);
+
+	int slot = find(cell_key);
+	if (slot < 0)
+		return false;
+
+	// sums and count are read apart from each other, a record landing in between only tilts the mean a little
+	const Cell& cell = table[slot];
+	uint32_t    count = load(cell.count);
+	if (count < MIN_SAMPLES)
+		return false;
+
+	for (int c = 0; c < 3; c++)
+		radiance[c] = load(cell.sum[c]) / count;
+	std::atomic_ref<uint64_t>(counter.hits).fetch_add(1, std::memory_order_relaxed);
+
+	return true;
+}
+
+void RadianceCache::record(const CacheVertex& vertex)
+{
+	if (table.empty() || !vertex.radiance.allFinite())
+		return;
+
+	int slot = claim(key(vertex.position, vertex.normal));
+	if (slot < 0)
+		return;
+
+	Cell& cell = table[slot];
+	for (int c = 0; c < 3; c++)
+		std::atomic_ref<float>(cell.sum[c]).fetch_add(vertex.radiance[c], std::memory_order_relaxed);
+	std::atomic_ref<uint32_t>(cell.count).fetch_add(1, std::memory_order_relaxed);
+}
+
+bool RadianceCache::empty() const
+{
+	return table.empty();
+}
+
+int RadianceCache::cells() const
+{
+	return static_cast<int>(std::count_if(table.begin(), table.end(), [](const Cell& cell) { return cell.key != 0; }));
+}
+
+float RadianceCache::hitRate() const
+{
+	uint64_t lookups = 0;
+	uint64_t hits = 0;
+	for (const Counter& counter : counters) {
+		lookups += counter.lookups;
+		hits += counter.hits;
+	}
+
+	return lookups ? static_cast<float>(hits) / lookups : 0.f;
+}
+
+void RadianceCache::resetStatistics()
+{
+	std::fill(counters.begin(), counters.end(), Counter{});
+}
+
+uint64_t RadianceCache::key(const vec3f_t& position, const vec3f_t& normal) const
+{
+	constexpr float MAX_COORDINATE = (1 << COORDINATE_BITS) - 1;
+
+	// 20 bits per axis of the cell's coordinates, then the axis the normal leans on most and which way it points
+	vec3f_t  cell = ((position - origin) * inverse_cell_size).cwiseMax(0.f).cwiseMin(MAX_COORDINATE);
+	int      axis;
+	float    largest = normal.cwiseAbs().maxCoeff(&axis);
+	uint64_t side = static_cast<uint64_t>(axis) << 1 | (normal[axis] < 0.f && largest > 0.f);
+
+	return USED | side << 3 * COORDINATE_BITS | static_cast<uint64_t>(cell.z()) << 2 * COORDINATE_BITS |
+	       static_cast<uint64_t>(cell.y()) << COORDINATE_BITS | static_cast<uint64_t>(cell.x());
+}
+
+int RadianceCache::find(uint64_t cell_key) const
+{
+	constexpr int MAX_PROBES = 16;
+
+	// linear probing, claims never move or free a cell so the first free slot ends the search
+	const size_t mask = table.size() - 1;
+	size_t       slot = mix(cell_key) & mask;
+	for (int probe = 0; probe < MAX_PROBES; probe++, slot = (slot + 1) & mask) {
+		uint64_t stored = load(table[slot].key, std::memory_order_acquire);
+		if (stored == cell_key)
+			return static_cast<int>(slot);
+		if (stored == 0)
+			return -1;
+	}
+
+	return -1;
+}
+
+int RadianceCache::claim(uint64_t cell_key)
+{
+	constexpr int MAX_PROBES = 16;
+
+	const size_t mask = table.size() - 1;
+	size_t       slot = mix(cell_key) & mask;
+	for (int probe = 0; probe < MAX_PROBES; probe++, slot = (slot + 1) & mask) {
+		std::atomic_ref<uint64_t> stored(table[slot].key);
+		uint64_t                  expected = stored.load(std::memory_order_acquire);
+		if (expected == 0 && stored.compare_exchange_strong(expected, cell_key, std::memory_order_acq_rel))
+			return static_cast<int>(slot);
+		if (expected == cell_key)
+			return static_cast<int>(slot);
+	}
+
+	return -1;
+}
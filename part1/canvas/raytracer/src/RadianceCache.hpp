@@ -0,0 +1,48 @@
+#pragma once
+
+#include <vector>
+
+#include "Bound.hpp"
+
+// a surface a filling path reached, its radiance gathered from everything the path finds further on
+struct CacheVertex {
+	vec3f_t position;
+	vec3f_t normal;
+	vec3f_t throughput;                  // of the path as it arrived, what later radiance is divided by
+	vec3f_t radiance{0, 0, 0};           // leaving toward where the path came from
+};
+
+// radiance leaving diffuse surfaces, averaged in cells of quantized position and normal that are hashed into a table of
+// fixed size; cells are claimed and added to with atomics, so any number of threads record and look up at once
+class RadianceCache {
+public:
+	void reset(const Bound& scene_bound, int resolution, int capacity);        // resolution in cells along the longest side
+	bool lookup(const vec3f_t& position, const vec3f_t& normal, vec3f_t& radiance) const;        // thread safe
+	void record(const CacheVertex& vertex);                                                      // thread safe
+	bool empty() const;
+	auto cells() const -> int;        // in use
+	auto hitRate() const -> float;    // of the lookups since resetStatistics
+	void resetStatistics();
+
+private:
+	struct Cell {
+		uint64_t key{};        // 0 for a free cell
+		float    sum[3]{};
+		uint32_t count{};
+	};
+
+	// lookups are counted in a few counters picked by cell, so threads rarely write the same cache line
+	struct alignas(64) Counter {
+		uint64_t lookups{};
+		uint64_t hits{};
+	};
+
+	vec3f_t                      origin{0, 0, 0};
+	float                        inverse_cell_size{};
+	std::vector<Cell>            table;
+	mutable std::vector<Counter> counters;
+
+	auto key(const vec3f_t& position, const vec3f_t& normal) const -> uint64_t;
+	auto find(uint64_t key) const -> int;        // -1 when the cell was never claimed
+	auto claim(uint64_t key) -> int;             // -1 when every slot it may take is held by other cells
+};
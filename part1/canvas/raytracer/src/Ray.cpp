@@ -1,6 +1,147 @@
 #include "Ray.hpp"
 
+#include <bit>
+
 vec3f_t Ray::at(double t) const
 {
 	return origin + t * direction;
 }
+
+bool HitRecord::hit() const
+{
+	return prim_id != INVALID;
+}
+
+void RayPacket::set(int index, const Ray& ray)
+{
+	for (int axis = 0; axis < 3; axis++) {
+		origin[axis][index] = ray.origin[axis];
+		direction[axis][index] = ray.direction[axis];
+		inv_dir[axis][index] = 1.f / ray.direction[axis];
+	}
+	tmax[index] = std::numeric_limits<float>::max();
+	hits[index] = HitRecord{};
+	active |= 1u << index;
+}
+
+Ray RayPacket::ray(int index) const
+{
+	return Ray{vec3f_t(origin[0][index], origin[1][index], origin[2][index]),
+	           vec3f_t(direction[0][index], direction[1][index], direction[2][index]), 0};
+}
+
+void RayPacket::record(int index, const HitRecord& hit)
+{
+	hits[index] = hit;
+	tmax[index] = hit.t;
+}
+
+void RayPacket::prepare()
+{
+	coherent = active != 0;
+	origin_min = inv_dir_min = vec3f_t::Constant(std::numeric_limits<float>::max());
+	origin_max = inv_dir_max = vec3f_t::Constant(std::numeric_limits<float>::lowest());
+	for (uint32_t mask = active; mask; mask &= mask - 1) {
+		int i = std::countr_zero(mask);
+		for (int axis = 0; axis < 3; axis++) {
+			origin_min[axis] = std::min(origin_min[axis], origin[axis][i]);
+			origin_max[axis] = std::max(origin_max[axis], origin[axis][i]);
+			inv_dir_min[axis] = std::min(inv_dir_min[axis], inv_dir[axis][i]);
+			inv_dir_max[axis] = std::max(inv_dir_max[axis], inv_dir[axis][i]);
+		}
+	}
+
+	// a ray parallel to a slab or rays pointing both ways leave no usable frustum
+	for (int axis = 0; axis < 3 && coherent; axis++)
+		coherent = std::isfinite(inv_dir_min[axis]) && std::isfinite(inv_dir_max[axis]) &&
+		           (inv_dir_min[axis] > 0 || inv_dir_max[axis] < 0);
+}
+
+bool RayPacket::missed(const vec3f_t& pmin, const vec3f_t& pmax) const
+{
+	if (!coherent)
+		return false;
+
+	// interval slab test: no ray enters before the latest lower entry bound or leaves after the earliest upper exit bound
+	float t_enter = 0.f;
+	float t_exit = std::numeric_limits<float>::max();
+	for (int axis = 0; axis < 3; axis++) {
+		bool  neg = inv_dir_max[axis] < 0;
+		float near_plane = neg ? pmax[axis] : pmin[axis];
+		float far_plane = neg ? pmin[axis] : pmax[axis];
+
+		float a = (near_plane - origin_max[axis]) * inv_dir_min[axis];
+		float b = (near_plane - origin_max[axis]) * inv_dir_max[axis];
+		float c = (near_plane - origin_min[axis]) * inv_dir_min[axis];
+		float d = (near_plane - origin_min[axis]) * inv_dir_max[axis];
+		t_enter = std::max(t_enter, std::min(std::min(a, b), std::min(c, d)));
+
+		a = (far_plane - origin_max[axis]) * inv_dir_min[axis];
+		b = (far_plane - origin_max[axis]) * inv_dir_max[axis];
+		c = (far_plane - origin_min[axis]) * inv_dir_min[axis];
+		d = (far_plane - origin_min[axis]) * inv_dir_max[axis];
+		t_exit = std::min(t_exit, std::max(std::max(a, b), std::max(c, d)));
+	}
+
+	return t_enter > t_exit;
+}
+
+uint32_t RayPacket::intersect(const vec3f_t& pmin, const vec3f_t& pmax, uint32_t mask, float& tnear) const
+{
+	// slab test of one box against every ray, the planes ordered per lane as the rays disagree on direction signs
+	alignas(32) float t_near[SIZE];
+	uint32_t          hit = 0;
+#if defined(SIMD_AVX)
+	for (int j = 0; j < SIZE; j += 8) {
+		__m256 t_enter = _mm256_setzero_ps();
+		__m256 t_exit = _mm256_load_ps(tmax + j);
+		for (int axis = 0; axis < 3; axis++) {
+			__m256 o = _mm256_load_ps(origin[axis] + j);
+			__m256 inv = _mm256_load_ps(inv_dir[axis] + j);
+			__m256 t0 = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(pmin[axis]), o), inv);
+			__m256 t1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(pmax[axis]), o), inv);
+			t_enter = _mm256_max_ps(_mm256_min_ps(t0, t1), t_enter);
+			t_exit = _mm256_min_ps(_mm256_max_ps(t0, t1), t_exit);
+		}
+		_mm256_store_ps(t_near + j, t_enter);
+		hit |= static_cast<uint32_t>(_mm256_movemask_ps(_mm256_cmp_ps(t_enter, t_exit, _CMP_LE_OQ))) << j;
+	}
+#elif defined(SIMD_SSE)
+	for (int j = 0; j < SIZE; j += 4) {
+		__m128 t_enter = _mm_setzero_ps();
+		__m128 t_exit = _mm_load_ps(tmax + j);
+		for (int axis = 0; axis < 3; axis++) {
+			__m128 o = _mm_load_ps(origin[axis] + j);
+			__m128 inv = _mm_load_ps(inv_dir[axis] + j);
+			__m128 t0 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(pmin[axis]), o), inv);
+			__m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(pmax[axis]), o), inv);
+			t_enter = _mm_max_ps(_mm_min_ps(t0, t1), t_enter);
+			t_exit = _mm_min_ps(_mm_max_ps(t0, t1), t_exit);
+		}
+		_mm_store_ps(t_near + j, t_enter);
+		hit |= static_cast<uint32_t>(_mm_movemask_ps(_mm_cmple_ps(t_enter, t_exit))) << j;
+	}
+#else
+	for (int i = 0; i < SIZE; i++) {
+		float t_enter = 0.f;
+		float t_exit = tmax[i];
+		for (int axis = 0; axis < 3; axis++) {
+			float t0 = (pmin[axis] - origin[axis][i]) * inv_dir[axis][i];
+			float t1 = (pmax[axis] - origin[axis][i]) * inv_dir[axis][i];
+			float t_near = t0 < t1 ? t0 : t1;
+			float t_far = t0 > t1 ? t0 : t1;
+			t_enter = t_near > t_enter ? t_near : t_enter;
+			t_exit = t_far < t_exit ? t_far : t_exit;
+		}
+		t_near[i] = t_enter;
+		hit |= static_cast<uint32_t>(t_enter <= t_exit) << i;
+	}
+#endif
+	hit &= mask;
+
+	tnear = std::numeric_limits<float>::max();
+	for (uint32_t m = hit; m; m &= m - 1)
+		tnear = std::min(tnear, t_near[std::countr_zero(m)]);
+
+	return hit;
+}
@@ -24,3 +24,42 @@ struct Intersection {
 	Material*  material{nullptr};
 	Primitive* primitive{nullptr};
 };
+
+// all traversal keeps of the closest hit so far, the surface is only evaluated for the final one
+struct HitRecord {
+	static constexpr uint32_t INVALID = ~0u;
+
+	float    t{std::numeric_limits<float>::max()};
+	uint32_t prim_id{INVALID};            // index into the ordered primitives of the BVH that found the hit
+	uint32_t instance_id{INVALID};        // scene level primitive the hit lies in, when that has a BVH of its own
+	float    u{}, v{};
+
+	bool hit() const;
+};
+
+// coherent rays traced together, stored per component so one instruction covers several rays
+struct RayPacket {
+	static constexpr int WIDTH = 4;
+	static constexpr int SIZE = WIDTH * WIDTH;
+
+	alignas(32) float origin[3][SIZE]{};
+	alignas(32) float direction[3][SIZE]{};
+	alignas(32) float inv_dir[3][SIZE]{};
+	alignas(32) float tmax[SIZE]{};
+
+	HitRecord hits[SIZE];
+	uint32_t  active{};
+
+	// interval bounds over the whole packet, only valid when every ray agrees on the direction signs
+	bool    coherent{};
+	vec3f_t origin_min, origin_max;
+	vec3f_t inv_dir_min, inv_dir_max;
+
+	void set(int index, const Ray& ray);
+	auto ray(int index) const -> Ray;
+	void record(int index, const HitRecord& hit);
+	void prepare();
+
+	bool missed(const vec3f_t& pmin, const vec3f_t& pmax) const;
+	auto intersect(const vec3f_t& pmin, const vec3f_t& pmax, uint32_t mask, float& tnear) const -> uint32_t;
+};
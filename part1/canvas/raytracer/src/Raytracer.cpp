@@ -3,58 +3,266 @@
 #include <iostream>
 #include <fstream>
 #include <thread>
-#include <mutex>
+#include <atomic>
+#include <bit>
+
+#include "ThreadPool.hpp"
+#include "Wavefront.hpp"
+#include "Accumulator.hpp"
+
+namespace
+{
+// what reservoir resampling needs to know of the surface a camera ray hit
+struct Surface {
+	vec3f_t   position{0, 0, 0};
+	vec3f_t   normal{0, 0, 0};
+	vec3f_t   direction{0, 0, 0};        // of the camera ray
+	float     depth{};
+	Material* material{};
+};
+
+// light from a sample reflected toward the camera, visibility aside; its luminance is the target function
+vec3f_t unshadowed(const Surface& surface, const LightSample& light)
+{
+	vec3f_t to_light = light.position - surface.position;
+	float   d2 = to_light.squaredNorm();
+	if (!surface.material || d2 <= 0.f)
+		return vec3f_t(0, 0, 0);
+
+	vec3f_t direction = to_light / std::sqrt(d2);
+	float   cos_surface = direction.dot(surface.normal);
+	float   cos_light = -direction.dot(light.normal);
+	if (cos_surface <= 0.f || cos_light <= 0.f)
+		return vec3f_t(0, 0, 0);
+
+	return light.emission.cwiseProduct(surface.material->eval(surface.direction, direction, surface.normal)) * cos_surface * cos_light / d2;
+}
+
+bool visible(const Scene& scene, const Surface& surface, const LightSample& light)
+{
+	constexpr float EPSILON = 0.0001f;
+
+	vec3f_t to_light = light.position - surface.position;
+	float   distance = to_light.norm();
+
+	return !scene.occluded(Ray(surface.position, to_light / distance), distance - EPSILON);
+}
+};        // namespace
 
 void Raytracer::render(Scene& new_scene)
 {
 	this->scene = &new_scene;
 	framebuffer.resize(scene->width * scene->height, vec3f_t::Zero());
+	sample_counts.resize(scene->width * scene->height, 0);
 	fov = 40.0f;
 	scale = std::tan(Geometry::radians(fov) / 2.0f);
 	aspect_ratio = static_cast<float>(scene->width) / static_cast<float>(scene->height);
 	camera_position = vec3f_t(278, 273, -800);
 
-	const int num_threads = std::thread::hardware_concurrency();
+	if (path_guiding)
+		trainGuiding();
+	else
+		scene->guide = SDTree();
 
-	std::vector<std::thread> threads;
-	std::atomic<int>         completed_pixels{0};
-	std::mutex               progress_mutex;
+	if (radiance_cache)
+		updateCache();
+	else
+		scene->cache = RadianceCache();
+
+	if (checkpoint_path.empty())
+		renderPass();
+	else
+		renderCheckpointed();
+
+	if (denoising) {
+		renderAOVs();
+		Denoiser denoiser(scene->width, scene->height, num_threads);
+		denoiser.iterations = denoise_iterations;
+		denoiser.apply(framebuffer, aovs);
+	}
+}
+
+void Raytracer::renderPass()
+{
+	if (direct_lighting == DirectLighting::RESTIR)
+		renderReSTIR();
+	else if (engine == Engine::WAVEFRONT)
+		Wavefront(*this, wavefront_batch).render();
+	else
+		renderTiles();
+}
+
+void Raytracer::renderCheckpointed()
+{
+	// an adaptive pass takes up to max_samples_per_pixel of each pixel's samples, which the next pass would take again
+	if (adaptive_sampling)
+		throw std::runtime_error("Adaptive sampling cannot be checkpointed: " + checkpoint_path);
+
+	Accumulator accumulator(checkpoint_path, scene->width, scene->height, seed);
+	if (accumulator.seed() != seed)
+		throw std::runtime_error("Checkpoint was rendered with another seed: " + checkpoint_path);
+	if (accumulator.nextSample() > 0)
+		std::cout << "Resuming at sample " << accumulator.nextSample() << " of " << samples_per_pixel << std::endl;
+
+	// every pass picks up the sample index the file has reached, so a resumed render takes the samples it had not yet
+	const int total = samples_per_pixel;
+	const int start = first_sample;
+	for (first_sample = accumulator.nextSample(); first_sample < total; first_sample += samples_per_pixel) {
+		samples_per_pixel = std::min(std::max(checkpoint_samples, 1), total - first_sample);
+		renderPass();
+		accumulator.add(framebuffer, sample_counts, first_sample + samples_per_pixel);
+		accumulator.checkpoint();
+	}
+	samples_per_pixel = total;
+	first_sample = start;
+
+	accumulator.resolve(framebuffer, sample_counts);
+}
+
+void Raytracer::renderTiles()
+{
+	const int threads_count = num_threads > 0 ? num_threads : std::max<int>(std::thread::hardware_concurrency(), 1);
+	const int tile = std::max(tile_size, 1);
+	const int tiles_x = (scene->width + tile - 1) / tile;
+	const int tiles_y = (scene->height + tile - 1) / tile;
+	const int total_pixels = scene->width * scene->height;
+
+	// tiles are handed out in morton order, so tiles rendered at the same time lie close together on screen
+	auto morton = [](uint32_t x, uint32_t y) {
+		auto spread = [](uint32_t v) {
+			v &= 0xffff;
+			v = (v | (v << 8)) & 0x00ff00ffu;
+			v = (v | (v << 4)) & 0x0f0f0f0fu;
+			v = (v | (v << 2)) & 0x33333333u;
+			v = (v | (v << 1)) & 0x55555555u;
+			return v;
+		};
+		return spread(x) | (spread(y) << 1);
+	};
+
+	std::vector<std::pair<uint32_t, int>> tiles;
+	tiles.reserve(tiles_x * tiles_y);
+	for (int ty = 0; ty < tiles_y; ty++)
+		for (int tx = 0; tx < tiles_x; tx++)
+			tiles.emplace_back(morton(tx, ty), ty * tiles_x + tx);
+	std::sort(tiles.begin(), tiles.end());
+
+	std::atomic<int> next_tile{0};
+	std::atomic<int> completed_pixels{0};
+
+	const int max_samples = adaptive_sampling ? std::max(max_samples_per_pixel, samples_per_pixel) : samples_per_pixel;
+	auto      converged = [&](const PixelEstimate& estimate) {
+		return estimate.count >= samples_per_pixel && (!adaptive_sampling || estimate.error() <= error_threshold);
+	};
 
-	auto render_rows = [&](int start_row, int end_row, int thread_id) {
-		std::random_device rd;
+	auto render_pixels = [&](int x0, int y0, int x1, int y1, Sampler& sampler, std::vector<PixelEstimate>& buffer) {
+		for (int j = y0; j < y1; j++) {
+			for (int i = x0; i < x1; i++) {
+				PixelEstimate estimate;
+				for (int k = 0; k < max_samples && !converged(estimate); k++) {
+					sampler.startPixel(i, j, first_sample + k);
+					estimate.add(scene->castRay(cameraRay(i, j, sampler), 0, sampler));
+				}
+
+				buffer[(j - y0) * tile + i - x0] = estimate;
+			}
+		}
+	};
 
-		std::mt19937 gen(rd() + thread_id);
+	// the paths of a pixel block go through the BVH together, primary rays as a coherent packet
+	// converged pixels leave the packet, the rest keep sampling together
+	auto render_packets = [&](int x0, int y0, int x1, int y1, Sampler* samplers, std::vector<PixelEstimate>& buffer) {
+		constexpr int BLOCK = RayPacket::WIDTH;
 
-		std::uniform_real_distribution<float> dis(0.0f, 1.0f);
+		for (int j = y0; j < y1; j += BLOCK) {
+			for (int i = x0; i < x1; i += BLOCK) {
+				PixelEstimate estimates[RayPacket::SIZE];
+				uint32_t      lanes = 0;
+				for (int r = 0; r < RayPacket::SIZE; r++)
+					if (i + r % BLOCK < x1 && j + r / BLOCK < y1)
+						lanes |= 1u << r;
 
-		for (int j = start_row; j < end_row; j++) {
-			for (int i = 0; i < scene->width; i++) {
-				float   x = (2.f * ((i + 0.5f) / scene->width) - 1.f) * scale * aspect_ratio;
-				float   y = (1.f - 2.f * ((j + 0.5f) / scene->height)) * scale;
-				vec3f_t ray_direction = vec3f_t(-x, y, 1).normalized();
-				vec3f_t pixel_color = vec3f_t::Zero();
+				for (int k = 0; k < max_samples && lanes; k++) {
+					PathState paths[RayPacket::SIZE];
+					RayPacket packet;
+					for (uint32_t mask = lanes; mask; mask &= mask - 1) {
+						int r = std::countr_zero(mask);
+						samplers[r].startPixel(i + r % BLOCK, j + r / BLOCK, first_sample + k);
+						paths[r].ray = cameraRay(i + r % BLOCK, j + r / BLOCK, samplers[r]);
+						packet.set(r, paths[r].ray);
+					}
 
-				for (int k = 0; k < samples_per_pixel; k++) {
-					pixel_color += scene->castRay(Ray(camera_position, ray_direction), 0);
+					// bounces scatter the paths apart, so only the camera rays share the traversal and the survivors are
+					// traced one by one
+					scene->intersect(packet);
+					for (uint32_t mask = lanes; mask; mask &= mask - 1) {
+						int       r = std::countr_zero(mask);
+						HitRecord hit = packet.hits[r];
+						while (scene->step(paths[r], hit, samplers[r])) {
+							hit = HitRecord{};
+							scene->intersect(paths[r].ray, hit);
+						}
+					}
+
+					for (uint32_t mask = lanes; mask; mask &= mask - 1) {
+						int r = std::countr_zero(mask);
+						estimates[r].add(paths[r].radiance);
+						if (converged(estimates[r]))
+							lanes &= ~(1u << r);
+					}
 				}
 
-				int pixel_index = j * scene->width + i;
-				framebuffer[pixel_index] = pixel_color / samples_per_pixel;
+				for (int r = 0; r < RayPacket::SIZE; r++)
+					if (i + r % BLOCK < x1 && j + r / BLOCK < y1)
+						buffer[(j + r / BLOCK - y0) * tile + i + r % BLOCK - x0] = estimates[r];
+			}
+		}
+	};
+
+	// workers pull tiles from a shared counter until none are left, so no thread idles while another has work
+	auto worker = [&]() {
+		Sampler samplers[RayPacket::SIZE];
+		for (auto& sampler : samplers)
+			sampler = Sampler(sampler_type, samples_per_pixel, seed);
+		std::vector<PixelEstimate> buffer(tile * tile);
+
+		for (int t; (t = next_tile.fetch_add(1, std::memory_order_relaxed)) < static_cast<int>(tiles.size());) {
+			int index = tiles[t].second;
+			int x0 = index % tiles_x * tile;
+			int y0 = index / tiles_x * tile;
+			int x1 = std::min(x0 + tile, scene->width);
+			int y1 = std::min(y0 + tile, scene->height);
+
+			if (packet_tracing)
+				render_packets(x0, y0, x1, y1, samplers, buffer);
+			else
+				render_pixels(x0, y0, x1, y1, samplers[0], buffer);
 
-				int current_completed = completed_pixels.fetch_add(1);
-				if (current_completed % 1000 == 0) {
-					std::lock_guard<std::mutex> lock(progress_mutex);
-					std::cout << "\rRendering: " << current_completed / 1000 << "k / " << (scene->width * scene->height) / 1000 << "k pixels" << std::flush;
+			for (int j = y0; j < y1; j++) {
+				for (int i = x0; i < x1; i++) {
+					const auto& estimate = buffer[(j - y0) * tile + i - x0];
+					framebuffer[j * scene->width + i] = estimate.sum / std::max(estimate.count, 1);
+					sample_counts[j * scene->width + i] = estimate.count;
 				}
 			}
+
+			completed_pixels.fetch_add((x1 - x0) * (y1 - y0), std::memory_order_relaxed);
+			completed_pixels.notify_one();
 		}
 	};
 
-	int rows_per_thread = scene->height / num_threads;
-	for (int t = 0; t < num_threads; t++) {
-		int start_row = t * rows_per_thread;
-		int end_row = (t == num_threads - 1) ? scene->height : (t + 1) * rows_per_thread;
-		threads.emplace_back(render_rows, start_row, end_row, t);
+	std::vector<std::thread> threads;
+	for (int t = 0; t < threads_count; t++)
+		threads.emplace_back(worker);
+
+	// only this thread prints, it sleeps until a tile finishes
+	for (int completed = 0, reported = -1; completed < total_pixels;) {
+		completed_pixels.wait(completed, std::memory_order_relaxed);
+		completed = completed_pixels.load(std::memory_order_relaxed);
+		if (completed / 1000 != reported) {
+			reported = completed / 1000;
+			std::cout << "\rRendering: " << reported << "k / " << total_pixels / 1000 << "k pixels" << std::flush;
+		}
 	}
 
 	for (auto& thread : threads)
@@ -63,10 +271,293 @@ void Raytracer::render(Scene& new_scene)
 	std::cout << std::endl;
 }
 
-void Raytracer::save(const std::string& filename)
+void Raytracer::renderReSTIR()
 {
-	constexpr float GAMMA = .6f;
+	constexpr float MIN_NORMAL_COSINE = 0.9f;
+	constexpr float MAX_DEPTH_DIFFERENCE = 0.1f;
+
+	const int width = scene->width;
+	const int height = scene->height;
+	const int pixels = width * height;
+	const int passes = std::max(samples_per_pixel, 1);
 
+	ThreadPool             pool(num_threads);
+	std::vector<Surface>   surfaces(pixels);
+	std::vector<vec3f_t>   radiance(pixels);
+	std::vector<vec3f_t>   sum(pixels, vec3f_t::Zero());
+	std::vector<Reservoir> initial(pixels);
+	if (reservoir_scene != scene || reservoir_emitters != scene->emitters.size() || static_cast<int>(reservoirs.size()) != pixels) {
+		reservoirs.assign(pixels, Reservoir{});
+		reservoir_scene = scene;
+		reservoir_emitters = scene->emitters.size();
+	}
+
+	for (int pass = 0; pass < passes; pass++) {
+		// candidates from the light sampler, the kept one tested for visibility and merged with the pixel's reservoir of the
+		// pass before; the rest of the path does not depend on any reservoir and is traced here too
+		pool.parallelFor(0, height, [&](int, int y0, int y1) {
+			Sampler sampler(sampler_type, passes, seed);
+			for (int j = y0; j < y1; j++) {
+				for (int i = 0; i < width; i++) {
+					int p = j * width + i;
+					sampler.startPixel(i, j, first_sample + pass);
+					Ray          ray = cameraRay(i, j, sampler);
+					Intersection hit = scene->intersect(ray);
+					surfaces[p] = Surface{};
+					radiance[p] = vec3f_t::Zero();
+					initial[p] = Reservoir{};
+					if (!hit.hit || !hit.material)
+						continue;
+					if (hit.material->hasEmission()) {
+						if (ray.direction.dot(hit.normal) < 0.f)
+							radiance[p] = hit.material->emission;
+						continue;
+					}
+
+					Surface& surface = surfaces[p];
+					surface = Surface{hit.position, hit.normal.normalized(), ray.direction, hit.distance, hit.material};
+
+					// weighted by target over source pdf, both per unit area so the sample means the same at any pixel
+					Reservoir& reservoir = initial[p];
+					for (int c = 0; c < restir_candidates; c++) {
+						Intersection light;
+						float        pdf;
+						scene->sampleLight(surface.position, surface.normal, light, pdf, sampler);
+						float       u = sampler.get1D();
+						LightSample candidate{light.position, light.normal.normalized(), light.emit};
+						vec3f_t     to_light = candidate.position - surface.position;
+						float       area_pdf = pdf * -to_light.normalized().dot(candidate.normal) / to_light.squaredNorm();
+						float       target = Geometry::luminance(unshadowed(surface, candidate));
+						if (pdf > 0.f && area_pdf > 0.f)
+							reservoir.update(candidate, target / area_pdf, target, u);
+					}
+					reservoir.count = restir_candidates;
+
+					const Reservoir& previous = reservoirs[p];
+					if (previous.contribution_weight > 0.f) {
+						int   history = std::min(previous.count, restir_history * restir_candidates);
+						float target = Geometry::luminance(unshadowed(surface, previous.sample));
+						reservoir.update(previous.sample, target * previous.contribution_weight * history, target, sampler.get1D());
+						reservoir.count += history;
+					}
+
+					// tested after the temporal merge, so a reservoir handed to a neighbour never keeps a sample its own pixel cannot see
+					if (reservoir.target > 0.f && !visible(*scene, surface, reservoir.sample)) {
+						reservoir.target = 0.f;
+						reservoir.weight_sum = 0.f;        // an occluded sample leaves only its count to reuse
+					}
+					reservoir.finalize(reservoir.count);
+
+					// a bounce that finds an emitter adds nothing, light at this vertex is the reservoir's part
+					PathState path{ray};
+					if (scene->scatter(path, hit, surface.normal, sampler)) {
+						path.bsdf_pdf = 0.f;
+						for (bool alive = true; alive;) {
+							HitRecord record;
+							scene->intersect(path.ray, record);
+							alive = scene->step(path, record, sampler);
+						}
+					}
+					radiance[p] = path.radiance;
+				}
+			}
+		});
+
+		// spatial reuse from random pixels nearby on a similar surface, then the kept sample is shaded
+		pool.parallelFor(0, height, [&](int, int y0, int y1) {
+			Pcg32            rng;
+			std::vector<int> merged;
+			for (int j = y0; j < y1; j++) {
+				for (int i = 0; i < width; i++) {
+					int            p = j * width + i;
+					const Surface& surface = surfaces[p];
+					Reservoir      reservoir;
+					if (surface.material) {
+						rng.seed(p, static_cast<uint64_t>(seed) << 32 | pass);
+						merged.assign(1, p);
+						for (int k = 0; k < restir_neighbours; k++) {
+							float angle = 2.f * PI * rng.nextFloat();
+							float radius = restir_radius * std::sqrt(rng.nextFloat());
+							int   x = i + static_cast<int>(std::round(radius * std::cos(angle)));
+							int   y = j + static_cast<int>(std::round(radius * std::sin(angle)));
+							if (x < 0 || x >= width || y < 0 || y >= height || y * width + x == p)
+								continue;
+
+							const Surface& other = surfaces[y * width + x];
+							if (other.material && other.normal.dot(surface.normal) >= MIN_NORMAL_COSINE &&
+							    std::fabs(other.depth - surface.depth) <= MAX_DEPTH_DIFFERENCE * surface.depth)
+								merged.push_back(y * width + x);
+						}
+
+						for (int q : merged) {
+							const Reservoir& other = initial[q];
+							float            target = Geometry::luminance(unshadowed(surface, other.sample));
+							int              count = reservoir.count;
+							reservoir.update(other.sample, target * other.contribution_weight * other.count, target, rng.nextFloat());
+							reservoir.count = count + other.count;
+						}
+
+						// only pixels that could have drawn the kept sample count toward its normalization, and after visibility
+						// reuse that means seeing it as well; skipping the shadow rays here darkens the image
+						int z = 0;
+						for (int q : merged)
+							if (Geometry::luminance(unshadowed(surfaces[q], reservoir.sample)) > 0.f &&
+							    (q == p || visible(*scene, surfaces[q], reservoir.sample)))
+								z += initial[q].count;
+						reservoir.count = z;
+						reservoir.finalize(z);
+					}
+
+					vec3f_t color = radiance[p];
+					if (reservoir.contribution_weight > 0.f && visible(*scene, surface, reservoir.sample))
+						color += unshadowed(surface, reservoir.sample) * reservoir.contribution_weight;
+					sum[p] += color;
+					reservoirs[p] = reservoir;
+				}
+			}
+		});
+
+		std::cout << "\rRendering: pass " << pass + 1 << " / " << passes << std::flush;
+	}
+	std::cout << std::endl;
+
+	for (int p = 0; p < pixels; p++) {
+		framebuffer[p] = sum[p] / passes;
+		sample_counts[p] = passes;
+	}
+}
+
+void Raytracer::trainGuiding()
+{
+	const int width = scene->width;
+	const int height = scene->height;
+
+	// training images are thrown away, only what the guide learnt from them is kept
+	ThreadPool pool(num_threads);
+	scene->guide.reset(scene->bvh->bound());
+	for (int pass = 0; pass < guiding_passes; pass++) {
+		int samples = 1 << pass;
+		pool.parallelFor(0, height, [&](int, int y0, int y1) {
+			Sampler                    sampler(sampler_type, samples, seed + pass + 1);
+			std::vector<GuidingVertex> vertices;
+			for (int j = y0; j < y1; j++) {
+				for (int i = 0; i < width; i++) {
+					for (int k = 0; k < samples; k++) {
+						sampler.startPixel(i, j, k);
+						vertices.clear();
+						scene->castRay(cameraRay(i, j, sampler), 0, sampler, &vertices);
+						for (const GuidingVertex& vertex : vertices)
+							scene->guide.record(vertex);
+					}
+				}
+			}
+		});
+		scene->guide.refine(samples);
+
+		std::cout << "\rTraining: pass " << pass + 1 << " / " << guiding_passes << std::flush;
+	}
+	std::cout << std::endl;
+}
+
+void Raytracer::updateCache()
+{
+	const int width = scene->width;
+	const int height = scene->height;
+
+	// filling paths never end at the cache, so every cell only averages what full paths found
+	ThreadPool pool(num_threads);
+	if (scene->cache.empty()) {
+		scene->cache.reset(scene->bvh->bound(), cache_resolution, cache_capacity);
+		cache_rounds = 0;
+	}
+	for (int pass = 0; pass < cache_passes; pass++, cache_rounds++) {
+		pool.parallelFor(0, height, [&](int, int y0, int y1) {
+			Sampler                  sampler(sampler_type, 1, seed + guiding_passes + cache_rounds + 1);
+			std::vector<CacheVertex> vertices;
+			for (int j = y0; j < y1; j++) {
+				for (int i = 0; i < width; i++) {
+					sampler.startPixel(i, j, 0);
+					PathState path{cameraRay(i, j, sampler)};
+					path.cache_vertices = &vertices;
+					vertices.clear();
+					for (bool alive = true; alive;) {
+						HitRecord hit;
+						scene->intersect(path.ray, hit);
+						alive = scene->step(path, hit, sampler);
+					}
+					for (const CacheVertex& vertex : vertices)
+						scene->cache.record(vertex);
+				}
+			}
+		});
+
+		std::cout << "\rCaching: pass " << pass + 1 << " / " << cache_passes << std::flush;
+	}
+	std::cout << std::endl;
+	scene->cache.resetStatistics();
+}
+
+void Raytracer::renderAOVs()
+{
+	constexpr int MAX_SAMPLES = 16;
+
+	// the first sub-samples of each pixel, placed as the render places them so edges fall where they do in the image
+	const int  width = scene->width;
+	const int  samples = std::clamp(samples_per_pixel, 1, MAX_SAMPLES);
+	ThreadPool pool(num_threads);
+	aovs.resize(width * scene->height);
+	pool.parallelFor(0, scene->height, [&](int, int y0, int y1) {
+		Sampler sampler(sampler_type, samples_per_pixel, seed);
+		for (int j = y0; j < y1; j++) {
+			for (int i = 0; i < width; i++) {
+				vec3f_t  albedo = vec3f_t::Zero();
+				vec3f_t  normal = vec3f_t::Zero();
+				float    depth = 0.f;
+				uint32_t primitive_id = HitRecord::INVALID;
+				bool     emissive = false;
+				int      hits = 0;
+				for (int k = 0; k < samples; k++) {
+					sampler.startPixel(i, j, first_sample + k);
+					Ray       ray = cameraRay(i, j, sampler);
+					HitRecord hit;
+					if (!scene->intersect(ray, hit))
+						continue;
+
+					Intersection surface = scene->getIntersection(ray, hit);
+					if (!surface.material)
+						continue;
+
+					emissive |= surface.material->hasEmission();
+					albedo += (surface.material->kd + surface.material->ks).cwiseMin(1.f);
+					normal += surface.normal.normalized();
+					depth += surface.distance;
+					if (!hits++)
+						primitive_id = hit.instance_id != HitRecord::INVALID ? hit.instance_id : hit.prim_id;
+				}
+
+				int p = j * width + i;
+				aovs.albedo[p] = albedo / std::max(hits, 1);
+				aovs.normals[p] = hits ? normal.normalized() : normal;
+				aovs.depths[p] = depth / std::max(hits, 1);
+				aovs.primitive_ids[p] = primitive_id;
+				aovs.emissive[p] = emissive;
+			}
+		}
+	});
+}
+
+Ray Raytracer::cameraRay(int i, int j, Sampler& sampler) const
+{
+	// the first sampler dimensions place the ray inside its pixel
+	vec2f_t jitter = sampler.get2D();
+	float   x = (2.f * ((i + jitter.x()) / scene->width) - 1.f) * scale * aspect_ratio;
+	float   y = (1.f - 2.f * ((j + jitter.y()) / scene->height)) * scale;
+
+	return Ray{camera_position, vec3f_t(-x, y, 1).normalized(), 0};
+}
+
+void Raytracer::save(const std::string& filename)
+{
 	std::ofstream file(filename, std::ios::binary);
 	if (!file.is_open())
 		throw std::runtime_error("Failed to open file for saving: " + filename);
@@ -74,9 +565,9 @@ void Raytracer::save(const std::string& filename)
 	file << "P6\n"
 	     << scene->width << " " << scene->height << "\n255\n";
 	for (const auto& color : framebuffer) {
-		unsigned char r = static_cast<unsigned char>(255.f * std::pow(std::clamp(color.x(), 0.f, 1.f), GAMMA));
-		unsigned char g = static_cast<unsigned char>(255.f * std::pow(std::clamp(color.y(), 0.f, 1.f), GAMMA));
-		unsigned char b = static_cast<unsigned char>(255.f * std::pow(std::clamp(color.z(), 0.f, 1.f), GAMMA));
+		unsigned char r = static_cast<unsigned char>(255.f * std::pow(std::clamp(color.x(), 0.f, 1.f), DISPLAY_GAMMA));
+		unsigned char g = static_cast<unsigned char>(255.f * std::pow(std::clamp(color.y(), 0.f, 1.f), DISPLAY_GAMMA));
+		unsigned char b = static_cast<unsigned char>(255.f * std::pow(std::clamp(color.z(), 0.f, 1.f), DISPLAY_GAMMA));
 		file.write(reinterpret_cast<const char*>(&r), sizeof(r));
 		file.write(reinterpret_cast<const char*>(&g), sizeof(g));
 		file.write(reinterpret_cast<const char*>(&b), sizeof(b));
@@ -84,3 +575,66 @@ void Raytracer::save(const std::string& filename)
 
 	file.close();
 }
+
+void Raytracer::savePFM(const std::string& filename) const
+{
+	std::ofstream file(filename, std::ios::binary);
+	if (!file.is_open())
+		throw std::runtime_error("Failed to open file for saving: " + filename);
+
+	// linear radiance as 32 bit floats, rows from the bottom up; a negative scale marks little endian data
+	file << "PF\n"
+	     << scene->width << " " << scene->height << "\n"
+	     << (std::endian::native == std::endian::little ? "-1.0" : "1.0") << "\n";
+	for (int j = scene->height - 1; j >= 0; j--) {
+		for (int i = 0; i < scene->width; i++) {
+			const vec3f_t& color = framebuffer[j * scene->width + i];
+			float          rgb[3] = {color.x(), color.y(), color.z()};
+			file.write(reinterpret_cast<const char*>(rgb), sizeof(rgb));
+		}
+	}
+
+	file.close();
+}
+
+void Raytracer::saveHeatmap(const std::string& filename) const
+{
+	std::ofstream file(filename, std::ios::binary);
+	if (!file.is_open())
+		throw std::runtime_error("Failed to open file for saving: " + filename);
+
+	// blue for the fewest samples taken, through green, to red for the most
+	auto [min_count, max_count] = std::minmax_element(sample_counts.begin(), sample_counts.end());
+	float range = std::max(*max_count - *min_count, 1);
+
+	file << "P6\n"
+	     << scene->width << " " << scene->height << "\n255\n";
+	for (int count : sample_counts) {
+		float         t = (count - *min_count) / range;
+		unsigned char rgb[3] = {static_cast<unsigned char>(255.f * t),
+		                        static_cast<unsigned char>(255.f * (1.f - std::fabs(2.f * t - 1.f))),
+		                        static_cast<unsigned char>(255.f * (1.f - t))};
+		file.write(reinterpret_cast<const char*>(rgb), sizeof(rgb));
+	}
+
+	file.close();
+}
+
+void PixelEstimate::add(const vec3f_t& color)
+{
+	// judged on the value as saved, so dark corners count as much as the eye sees them and a firefly cannot exceed white
+	double y = std::pow(std::clamp(Geometry::luminance(color), 0.f, 1.f), DISPLAY_GAMMA);
+	sum += color;
+	count++;
+	double delta = y - mean;
+	mean += delta / count;
+	m2 += delta * (y - mean);
+}
+
+double PixelEstimate::error() const
+{
+	if (count < 2)
+		return std::numeric_limits<double>::max();
+
+	return std::sqrt(m2 / (count - 1) / count);
+}
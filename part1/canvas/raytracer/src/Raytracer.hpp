@@ -1,12 +1,79 @@
 #pragma once
 
 #include "Scene.hpp"
+#include "Reservoir.hpp"
+#include "Denoiser.hpp"
+
+constexpr float DISPLAY_GAMMA = .6f;
+
+// running mean and variance of a pixel's displayed luminance, updated per sample with Welford's method
+struct PixelEstimate {
+	vec3f_t sum{0, 0, 0};
+	double  mean{};
+	double  m2{};
+	int     count{};
+
+	void add(const vec3f_t& color);
+	auto error() const -> double;
+};
+
+enum class DirectLighting {
+	PATH,         // a light sample per path vertex
+	RESTIR        // at camera hits, light samples resampled and shared between pixels and passes
+};
+
+enum class Engine {
+	TILES,           // each thread traces whole paths of the pixels in a tile, one after another
+	WAVEFRONT        // batches of paths advance through one stage at a time, see Wavefront
+};
 
 class Raytracer {
 public:
 	Scene* scene;
 
-	int samples_per_pixel{16};
+	int         samples_per_pixel{16};
+	bool        packet_tracing{true};
+	SamplerType sampler_type{SamplerType::SOBOL};
+	uint32_t    seed{0};
+	int         num_threads{0};        // 0 uses every hardware thread
+	int         tile_size{16};
+	Engine      engine{Engine::TILES};
+	int         wavefront_batch{1 << 18};        // paths in flight at once in wavefront mode
+
+	// adaptive mode keeps sampling a pixel past samples_per_pixel until its standard error drops below the threshold, tile engine only
+	bool  adaptive_sampling{false};
+	int   max_samples_per_pixel{256};
+	float error_threshold{0.02f};
+
+	// guided mode first renders passes of 1, 2, 4, ... samples per pixel, each learning where light arrives from for the next
+	bool path_guiding{false};
+	int  guiding_passes{5};
+
+	// cached mode ends paths scene->cache_depth bounces in at a hashed cache of what leaves diffuse surfaces, first filled by
+	// cache_passes full length paths per pixel; it is kept between renders, each adding its passes to the cells
+	bool radiance_cache{false};
+	int  cache_passes{4};
+	int  cache_resolution{64};             // cells along the scene's longest side
+	int  cache_capacity{1 << 20};          // cells the table holds
+	int  cache_rounds{};                   // passes recorded so far, later ones take new samples
+
+	// checkpointed mode renders samples_per_pixel in passes of checkpoint_samples, adding each to the accumulation file at
+	// checkpoint_path and flushing it after every pass; a file left by an earlier run with the same seed is resumed where
+	// it stopped. Adaptive sampling is not checkpointed
+	std::string checkpoint_path;
+	int         checkpoint_samples{4};
+	int         first_sample{0};        // sample index a render starts at, so passes never repeat samples
+
+	// denoised mode filters the finished image, guided by buffers of what each pixel's camera rays hit first
+	bool denoising{false};
+	int  denoise_iterations{4};
+
+	// reservoir mode renders samples_per_pixel passes over the whole image, each reusing the reservoirs of the one before
+	DirectLighting direct_lighting{DirectLighting::PATH};
+	int            restir_candidates{16};        // light samples resampled per pixel and pass
+	int            restir_neighbours{5};         // reservoirs merged from nearby pixels
+	float          restir_radius{30.f};          // in pixels
+	int            restir_history{2};            // cap on M in multiples of restir_candidates, short as passes are averaged
 
 	float fov;
 	float scale;
@@ -15,8 +82,23 @@ public:
 	vec3f_t background_color;
 	vec3f_t camera_position;
 
-	std::vector<vec3f_t> framebuffer;
+	std::vector<vec3f_t>   framebuffer;
+	std::vector<int>       sample_counts;
+	std::vector<Reservoir> reservoirs;                  // per pixel, carried over between passes and calls to render
+	const Scene*           reservoir_scene{};           // what the reservoirs were gathered on, they are dropped when it,
+	size_t                 reservoir_emitters{};        // its emitters or the resolution change
+	AOVBuffers             aovs;
 
 	void render(Scene& new_scene);
+	void renderPass();
+	void renderTiles();
+	void renderCheckpointed();
+	void renderReSTIR();
+	void trainGuiding();
+	void updateCache();
+	void renderAOVs();
+	auto cameraRay(int i, int j, Sampler& sampler) const -> Ray;
 	void save(const std::string& filename);
+	void savePFM(const std::string& filename) const;
+	void saveHeatmap(const std::string& filename) const;
 };
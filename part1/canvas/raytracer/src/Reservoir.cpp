@@ -0,0 +1,20 @@
+#include "Reservoir.hpp"
+
+bool Reservoir::update(const LightSample& candidate, float weight, float candidate_target, float u)
+{
+	// keeps every candidate with probability in proportion to its weight, one at a time
+	weight_sum += weight;
+	if (!(weight > 0.f) || u * weight_sum >= weight)
+		return false;
+
+	sample = candidate;
+	target = candidate_target;
+
+	return true;
+}
+
+void Reservoir::finalize(int samples)
+{
+	// samples is M, or for reused reservoirs only those whose pixel could have produced the kept sample
+	contribution_weight = target > 0.f && samples > 0 ? weight_sum / (static_cast<float>(samples) * target) : 0.f;
+}
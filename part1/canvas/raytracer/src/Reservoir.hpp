@@ -0,0 +1,22 @@
+#pragma once
+
+#include "global.hpp"
+
+// a point on an emitter, kept in area measure so it stays valid when handed to another pixel
+struct LightSample {
+	vec3f_t position{0, 0, 0};
+	vec3f_t normal{0, 0, 0};
+	vec3f_t emission{0, 0, 0};
+};
+
+// weighted reservoir over light samples, Bitterli et al.'s spatiotemporal reservoir resampling
+struct Reservoir {
+	LightSample sample;
+	float       weight_sum{};
+	float       target{};                     // target function of the kept sample at the reservoir's pixel
+	float       contribution_weight{};        // W, unbiased reciprocal of the kept sample's pdf
+	int         count{};                      // M, candidates seen
+
+	bool update(const LightSample& candidate, float weight, float candidate_target, float u);
+	void finalize(int samples);
+};
@@ -0,0 +1,248 @@
+#include "SDTree.hpp"
+
+#include <atomic>
+
+namespace
+{
+// cos theta and phi over the unit square, equal areas on both sides
+vec2f_t toSquare(const vec3f_t& direction)
+{
+	float cos_theta = std::clamp(direction.z(), -1.f, 1.f);
+	float phi = std::atan2(direction.y(), direction.x());
+	if (phi < 0.f)
+		phi += 2.f * PI;
+
+	return vec2f_t((cos_theta + 1.f) / 2.f, phi / (2.f * PI)).cwiseMin(0x1.fffffep-1f);
+}
+
+vec3f_t toDirection(const vec2f_t& p)
+{
+	float cos_theta = 2.f * p.x() - 1.f;
+	float sin_theta = std::sqrt(std::max(0.f, 1.f - cos_theta * cos_theta));
+	float phi = 2.f * PI * p.y();
+
+	return vec3f_t(sin_theta * std::cos(phi), sin_theta * std::sin(phi), cos_theta);
+}
+
+// quadrant of a point of the unit square, x in the low bit; the point is stretched over the quadrant's square
+int quadrant(vec2f_t& p)
+{
+	int x = p.x() >= .5f;
+	int y = p.y() >= .5f;
+	p = (2.f * p - vec2f_t(x, y)).cwiseMin(0x1.fffffep-1f);
+
+	return x | y << 1;
+}
+};        // namespace
+
+DTree::DTree()
+    : nodes(1)
+{
+}
+
+vec3f_t DTree::sample(const vec2f_t& u) const
+{
+	// the x half first, then the y half within it, each by its share of the energy; u is stretched after every choice
+	vec2f_t p = u;
+	vec2f_t origin(0, 0);
+	float   size = 1.f;
+	for (int node = 0;;) {
+		const Node& current = nodes[node];
+		float       left = current.sum[0] + current.sum[2];
+		float       right = current.sum[1] + current.sum[3];
+		if (!(left + right > 0.f))
+			break;
+
+		float p_left = left / (left + right);
+		int   x = p.x() >= p_left;
+		p.x() = x ? (p.x() - p_left) / (1.f - p_left) : p.x() / p_left;
+
+		float lower = current.sum[x];
+		float upper = current.sum[x + 2];
+		float p_lower = lower / (lower + upper);
+		int   y = p.y() >= p_lower;
+		p.y() = y ? (p.y() - p_lower) / (1.f - p_lower) : p.y() / p_lower;
+		p = p.cwiseMin(0x1.fffffep-1f);
+
+		size /= 2.f;
+		origin += vec2f_t(x, y) * size;
+		node = current.children[x | y << 1];
+		if (!node)
+			break;
+	}
+
+	return toDirection(origin + p * size);
+}
+
+float DTree::pdf(const vec3f_t& direction) const
+{
+	vec2f_t p = toSquare(direction);
+	float   density = 1.f;
+	for (int node = 0;;) {
+		const Node& current = nodes[node];
+		float       sum = current.sum[0] + current.sum[1] + current.sum[2] + current.sum[3];
+		if (!(sum > 0.f))
+			return 0.f;
+
+		int q = quadrant(p);
+		density *= 4.f * current.sum[q] / sum;
+		node = current.children[q];
+		if (!node)
+			break;
+	}
+
+	// the square maps onto the sphere with a constant jacobian
+	return density / (4.f * PI);
+}
+
+void DTree::record(const vec3f_t& direction, float energy)
+{
+	if (!(energy > 0.f) || !std::isfinite(energy))
+		return;
+
+	vec2f_t p = toSquare(direction);
+	for (int node = 0;;) {
+		int q = quadrant(p);
+		std::atomic_ref<float>(nodes[node].sum[q]).fetch_add(energy, std::memory_order_relaxed);
+		node = nodes[node].children[q];
+		if (!node)
+			break;
+	}
+}
+
+void DTree::refine(const DTree& previous, float threshold)
+{
+	nodes.assign(1, Node{});
+	float total = previous.total();
+	if (total > 0.f)
+		split(0, previous.nodes[0].sum, previous, 0, threshold * total, 1);
+}
+
+void DTree::split(int node, const float sums[4], const DTree& previous, int previous_node, float threshold, int depth)
+{
+	constexpr int MAX_DEPTH = 20;
+
+	// a quadrant that held more than its share of the energy is split, past the previous tree's leaves its energy is
+	// taken as spread evenly
+	for (int q = 0; q < 4 && depth < MAX_DEPTH; q++) {
+		if (sums[q] <= threshold)
+			continue;
+
+		int   previous_child = previous_node >= 0 ? previous.nodes[previous_node].children[q] : 0;
+		float child_sums[4] = {sums[q] / 4.f, sums[q] / 4.f, sums[q] / 4.f, sums[q] / 4.f};
+		if (previous_child)
+			std::copy(previous.nodes[previous_child].sum, previous.nodes[previous_child].sum + 4, child_sums);
+
+		int child = static_cast<int>(nodes.size());
+		nodes.emplace_back();
+		nodes[node].children[q] = child;
+		split(child, child_sums, previous, previous_child ? previous_child : -1, threshold, depth + 1);
+	}
+}
+
+float DTree::total() const
+{
+	return nodes[0].sum[0] + nodes[0].sum[1] + nodes[0].sum[2] + nodes[0].sum[3];
+}
+
+void SDTree::reset(const Bound& scene_bound)
+{
+	// a cube, so halving along each axis in turn keeps the cells cubes too
+	float extent = scene_bound.diagonal().maxCoeff() * 1.01f / 2.f;
+	bound = Bound(scene_bound.centroid() - vec3f_t::Constant(extent), scene_bound.centroid() + vec3f_t::Constant(extent));
+	nodes.assign(1, Node{});
+	leaves.assign(1, Leaf{});
+}
+
+const DTree* SDTree::find(const vec3f_t& position) const
+{
+	if (leaves.empty())
+		return nullptr;
+
+	const DTree& tree = leaves[lookup(position)].sampling;
+
+	return tree.total() > 0.f ? &tree : nullptr;
+}
+
+void SDTree::record(const GuidingVertex& vertex)
+{
+	if (leaves.empty() || !(vertex.pdf > 0.f))
+		return;
+
+	Leaf& leaf = leaves[lookup(vertex.position)];
+	std::atomic_ref<int>(leaf.samples).fetch_add(1, std::memory_order_relaxed);
+	leaf.building.record(vertex.direction, Geometry::luminance(vertex.radiance) / vertex.pdf);
+}
+
+void SDTree::refine(int samples_per_pixel)
+{
+	constexpr float SPATIAL_THRESHOLD = 12000.f;          // records a leaf may take in a pass of one sample per pixel
+	constexpr float DIRECTIONAL_THRESHOLD = 0.01f;        // share of a quadtree's energy a quadrant may hold
+
+	if (leaves.empty())
+		return;
+
+	// more samples per pass buy finer cells, at the square root so each cell's quadtree still gets more to learn from
+	split(0, static_cast<int>(SPATIAL_THRESHOLD * std::sqrt(static_cast<float>(samples_per_pixel))));
+	for (Leaf& leaf : leaves) {
+		leaf.sampling = leaf.building;
+		leaf.building.refine(leaf.sampling, DIRECTIONAL_THRESHOLD);
+		leaf.samples = 0;
+	}
+}
+
+bool SDTree::empty() const
+{
+	for (const Leaf& leaf : leaves)
+		if (leaf.sampling.total() > 0.f)
+			return false;
+
+	return true;
+}
+
+int SDTree::lookup(const vec3f_t& position) const
+{
+	vec3f_t pmin = bound.pmin;
+	vec3f_t pmax = bound.pmax;
+	int     node = 0;
+	while (nodes[node].children[0]) {
+		int   axis = nodes[node].axis;
+		float mid = (pmin[axis] + pmax[axis]) / 2.f;
+		if (position[axis] < mid) {
+			pmax[axis] = mid;
+			node = nodes[node].children[0];
+		} else {
+			pmin[axis] = mid;
+			node = nodes[node].children[1];
+		}
+	}
+
+	return nodes[node].leaf;
+}
+
+void SDTree::split(int node, int threshold)
+{
+	if (nodes[node].children[0]) {
+		split(nodes[node].children[0], threshold);
+		split(nodes[node].children[1], threshold);
+		return;
+	}
+
+	// both halves start from the whole leaf's quadtrees and half its records
+	int leaf = nodes[node].leaf;
+	if (leaves[leaf].samples <= threshold)
+		return;
+
+	leaves[leaf].samples /= 2;
+	leaves.push_back(leaves[leaf]);
+
+	int axis = (nodes[node].axis + 1) % 3;
+	int first = static_cast<int>(nodes.size());
+	nodes.push_back(Node{axis, {}, leaf});
+	nodes.push_back(Node{axis, {}, static_cast<int>(leaves.size()) - 1});
+	nodes[node].children[0] = first;
+	nodes[node].children[1] = first + 1;
+
+	split(first, threshold);
+	split(first + 1, threshold);
+}
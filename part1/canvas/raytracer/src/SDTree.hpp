@@ -0,0 +1,69 @@
+#pragma once
+
+#include <vector>
+
+#include "Bound.hpp"
+#include "Sampler.hpp"
+
+// a scattering event of a training path, its radiance gathered from everything the path finds further on
+struct GuidingVertex {
+	vec3f_t position;
+	vec3f_t direction;
+	vec3f_t throughput;                  // of the path once it leaves in direction, what later radiance is divided by
+	vec3f_t radiance{0, 0, 0};           // arriving along direction
+	float   pdf{};                       // direction was sampled with
+};
+
+// quadtree over the sphere of directions, mapped area preserving onto the unit square by cos theta and phi;
+// each node keeps the energy recorded in its four quadrants and splits those holding much of the total
+class DTree {
+public:
+	DTree();
+
+	auto sample(const vec2f_t& u) const -> vec3f_t;
+	auto pdf(const vec3f_t& direction) const -> float;        // per unit solid angle
+	void record(const vec3f_t& direction, float energy);        // thread safe
+	void refine(const DTree& previous, float threshold);        // this takes the shape previous earned, with nothing recorded
+	auto total() const -> float;
+
+private:
+	struct Node {
+		float sum[4]{};
+		int   children[4]{};        // 0 for a quadrant not split further
+	};
+
+	std::vector<Node> nodes;
+
+	void split(int node, const float sums[4], const DTree& previous, int previous_node, float threshold, int depth);
+};
+
+// Mueller et al.'s practical path guiding, a binary tree halving space along alternating axes whose leaves hold
+// a quadtree to sample from, learnt in the pass before, and one being recorded into
+class SDTree {
+public:
+	void reset(const Bound& scene_bound);
+	auto find(const vec3f_t& position) const -> const DTree*;        // null where nothing has been learnt yet
+	void record(const GuidingVertex& vertex);                         // thread safe
+	void refine(int samples_per_pixel);
+	bool empty() const;
+
+private:
+	struct Node {
+		int axis{};
+		int children[2]{};        // 0 for a leaf
+		int leaf{};               // into leaves
+	};
+
+	struct Leaf {
+		DTree sampling;
+		DTree building;
+		int   samples{};
+	};
+
+	Bound             bound;
+	std::vector<Node> nodes;
+	std::vector<Leaf> leaves;
+
+	auto lookup(const vec3f_t& position) const -> int;
+	void split(int node, int threshold);
+};
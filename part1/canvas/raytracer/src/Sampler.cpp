@@ -0,0 +1,198 @@
+#include "Sampler.hpp"
+
+namespace
+{
+uint32_t hash(uint32_t x)
+{
+	x ^= x >> 16;
+	x *= 0x7feb352du;
+	x ^= x >> 15;
+	x *= 0x846ca68bu;
+	x ^= x >> 16;
+
+	return x;
+}
+
+uint32_t hash(uint32_t a, uint32_t b)
+{
+	return hash(a ^ hash(b));
+}
+
+uint32_t reverseBits(uint32_t x)
+{
+	x = (x << 16) | (x >> 16);
+	x = ((x & 0x00ff00ffu) << 8) | ((x & 0xff00ff00u) >> 8);
+	x = ((x & 0x0f0f0f0fu) << 4) | ((x & 0xf0f0f0f0u) >> 4);
+	x = ((x & 0x33333333u) << 2) | ((x & 0xccccccccu) >> 2);
+	x = ((x & 0x55555555u) << 1) | ((x & 0xaaaaaaaau) >> 1);
+
+	return x;
+}
+
+float toFloat(uint32_t x)
+{
+	return (x >> 8) * 0x1p-24f;
+}
+
+// random permutation of [0, n) indexed by i, Kensler's correlated multi-jittered sampling
+uint32_t permute(uint32_t i, uint32_t n, uint32_t p)
+{
+	uint32_t w = n - 1;
+	w |= w >> 1;
+	w |= w >> 2;
+	w |= w >> 4;
+	w |= w >> 8;
+	w |= w >> 16;
+	do {
+		i ^= p;
+		i *= 0xe170893du;
+		i ^= p >> 16;
+		i ^= (i & w) >> 4;
+		i ^= p >> 8;
+		i *= 0x0929eb3fu;
+		i ^= p >> 23;
+		i ^= (i & w) >> 1;
+		i *= 1 | p >> 27;
+		i *= 0x6935fa69u;
+		i ^= (i & w) >> 11;
+		i *= 0x74dcb303u;
+		i ^= (i & w) >> 2;
+		i *= 0x9e501cc3u;
+		i ^= (i & w) >> 2;
+		i *= 0xc860a3dfu;
+		i &= w;
+		i ^= i >> 5;
+	} while (i >= n);
+
+	return (i + p) % n;
+}
+
+// owen scrambling of the bits of x as a hash, Burley's practical hash-based owen scrambling
+uint32_t nestedUniformScramble(uint32_t x, uint32_t seed)
+{
+	x = reverseBits(x);
+	x += seed;
+	x ^= x * 0x6c50b47cu;
+	x ^= x * 0xb82f1e52u;
+	x ^= x * 0xc7afe638u;
+	x ^= x * 0x8d22f6e6u;
+
+	return reverseBits(x);
+}
+
+// second sobol dimension, the first one is the bit reversed index
+uint32_t sobolSecond(uint32_t index)
+{
+	uint32_t res = 0;
+	for (uint32_t v = 1u << 31; index; index >>= 1, v ^= v >> 1)
+		if (index & 1)
+			res ^= v;
+
+	return res;
+}
+};        // namespace
+
+void Pcg32::seed(uint64_t init_state, uint64_t sequence)
+{
+	state = 0;
+	inc = (sequence << 1) | 1;
+	next();
+	state += init_state;
+	next();
+}
+
+uint32_t Pcg32::next()
+{
+	uint64_t old_state = state;
+	state = old_state * 6364136223846793005ULL + inc;
+	uint32_t xorshifted = static_cast<uint32_t>(((old_state >> 18) ^ old_state) >> 27);
+	uint32_t rot = static_cast<uint32_t>(old_state >> 59);
+
+	return (xorshifted >> rot) | (xorshifted << ((-rot) & 31));
+}
+
+float Pcg32::nextFloat()
+{
+	return toFloat(next());
+}
+
+Sampler::Sampler(SamplerType type, int samples_per_pixel, uint32_t seed) :
+    type(type),
+    samples_per_pixel(std::max(samples_per_pixel, 1)),
+    seed(seed)
+{}
+
+void Sampler::startPixel(int x, int y, int sample)
+{
+	pixel_x = x;
+	pixel_y = y;
+	pixel_seed = hash(hash(x, y), seed);
+	sample_index = sample;
+	dimension = 0;
+	rng.seed(hash(pixel_seed, sample), pixel_seed);
+}
+
+float Sampler::get1D()
+{
+	return get2D().x();
+}
+
+vec2f_t Sampler::get2D()
+{
+	// every call takes its own dimension, so each decision in a path sees a fresh well distributed pattern
+	uint32_t d = dimension++;
+	switch (type) {
+	case SamplerType::STRATIFIED:
+		return stratified(hash(pixel_seed, d));
+	case SamplerType::SOBOL:
+		return sobol(hash(pixel_seed, d));
+	case SamplerType::BLUE_NOISE:
+		return blueNoise(d);
+	default:
+		return vec2f_t(rng.nextFloat(), rng.nextFloat());
+	}
+}
+
+vec2f_t Sampler::stratified(uint32_t dimension_seed) const
+{
+	// jittered grid over the samples of a pixel, strata visited in a per pixel and dimension order
+	int      n = samples_per_pixel;
+	int      m = std::max(static_cast<int>(std::sqrt(static_cast<float>(n))), 1);
+	int      k = (n + m - 1) / m;
+	int      s = sample_index % n;
+	uint32_t p = hash(dimension_seed, sample_index / n);
+
+	s = permute(s, n, p * 0x51633e2du);
+	int   sx = permute(s % m, m, p * 0x68bc21ebu);
+	int   sy = permute(s / m, k, p * 0x02e5be93u);
+	float jx = toFloat(hash(s, p * 0x967a889bu));
+	float jy = toFloat(hash(s, p * 0x368cc8b7u));
+
+	return vec2f_t(std::min((s % m + (sy + jx) / k) / m, 0x1.fffffep-1f),
+	               std::min((s / m + (sx + jy) / m) / k, 0x1.fffffep-1f));
+}
+
+vec2f_t Sampler::sobol(uint32_t dimension_seed) const
+{
+	// shuffled and scrambled (0,2) sequence per pair of dimensions
+	uint32_t index = nestedUniformScramble(sample_index, dimension_seed);
+	uint32_t x = nestedUniformScramble(reverseBits(index), hash(dimension_seed, 1));
+	uint32_t y = nestedUniformScramble(sobolSecond(index), hash(dimension_seed, 2));
+
+	return vec2f_t(toFloat(x), toFloat(y));
+}
+
+vec2f_t Sampler::blueNoise(uint32_t dimension) const
+{
+	// every pixel runs the same sequence, shifted by a screen space R2 pattern so the error between neighbours is blue
+	constexpr double A1 = 0.7548776662466927;        // 1 / g, g the plastic number
+	constexpr double A2 = 0.5698402909980532;        // 1 / g^2
+
+	vec2f_t value = sobol(hash(seed, dimension));
+	double  offset_x = 0.5 + pixel_x * A1 + pixel_y * A2 + toFloat(hash(dimension, 1));
+	double  offset_y = 0.5 + pixel_x * A2 + pixel_y * A1 + toFloat(hash(dimension, 2));
+	float   x = static_cast<float>(value.x() + offset_x - std::floor(value.x() + offset_x));
+	float   y = static_cast<float>(value.y() + offset_y - std::floor(value.y() + offset_y));
+
+	return vec2f_t(std::min(x, 0x1.fffffep-1f), std::min(y, 0x1.fffffep-1f));
+}
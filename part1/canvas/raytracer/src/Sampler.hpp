@@ -0,0 +1,48 @@
+#pragma once
+
+#include <cstdint>
+
+#include "global.hpp"
+
+enum class SamplerType {
+	RANDOM,
+	STRATIFIED,
+	SOBOL,
+	BLUE_NOISE
+};
+
+// small fast generator with a 64 bit state, one per sampler instead of a seeded mt19937 per call
+struct Pcg32 {
+	uint64_t state{0x853c49e6748fea9bULL};
+	uint64_t inc{0xda3e39cb94b95bdbULL};
+
+	void seed(uint64_t init_state, uint64_t sequence = 1);
+	auto next() -> uint32_t;
+	auto nextFloat() -> float;
+};
+
+// sample values are a function of (pixel, sample, dimension) only, so a render does not depend on which thread ran a pixel
+class Sampler {
+public:
+	explicit Sampler(SamplerType type = SamplerType::SOBOL, int samples_per_pixel = 16, uint32_t seed = 0);
+
+	void startPixel(int x, int y, int sample);
+	auto get1D() -> float;
+	auto get2D() -> vec2f_t;
+
+private:
+	SamplerType type;
+	int         samples_per_pixel;
+	uint32_t    seed;
+
+	int      pixel_x{};
+	int      pixel_y{};
+	uint32_t pixel_seed{};
+	int      sample_index{};
+	int      dimension{};
+	Pcg32    rng;
+
+	auto stratified(uint32_t dimension_seed) const -> vec2f_t;
+	auto sobol(uint32_t dimension_seed) const -> vec2f_t;
+	auto blueNoise(uint32_t dimension) const -> vec2f_t;
+};
@@ -1,13 +1,77 @@
 #include "Scene.hpp"
 
+namespace
+{
+// Veach's power heuristic with an exponent of two
+float powerHeuristic(float pdf, float other_pdf)
+{
+	float a = pdf * pdf;
+	float b = other_pdf * other_pdf;
+
+	return a + b > 0.f ? a / (a + b) : 0.f;
+}
+
+uint64_t emitterKey(uint32_t instance_id, uint32_t prim_id)
+{
+	return static_cast<uint64_t>(instance_id) << 32 | prim_id;
+}
+
+// one half of an area light's rectangle, wound so its face normal is the light's
+Triangle* rectangleHalf(AreaLight& light, const vec3f_t& a, const vec3f_t& b, const vec3f_t& c)
+{
+	bool flip = (b - a).cross(c - a).dot(light.normal) < 0.f;
+
+	auto* triangle = new Triangle();
+	triangle->v0 = a;
+	triangle->v1 = flip ? c : b;
+	triangle->v2 = flip ? b : c;
+	triangle->n0 = triangle->n1 = triangle->n2 = light.normal.normalized();
+	triangle->sarea = triangle->area();
+	triangle->material = &light.material;
+
+	return triangle;
+}
+
+// pdf of a direction scatter could take, the bsdf's alone or its one-sample mixture with a learnt distribution
+float scatterPdf(const DTree* guide, float bsdf_fraction, const Material& material, const vec3f_t& wi, const vec3f_t& wo, const vec3f_t& normal)
+{
+	float pdf = material.pdf(wi, wo, normal);
+
+	return guide ? bsdf_fraction * pdf + (1.f - bsdf_fraction) * guide->pdf(wo) : pdf;
+}
+};        // namespace
+
+void PathState::add(const vec3f_t& contribution)
+{
+	radiance += contribution;
+
+	// every earlier vertex sees it arrive, divided by the throughput the path had gathered by then
+	if (vertices)
+		for (GuidingVertex& vertex : *vertices)
+			for (int c = 0; c < 3; c++)
+				if (vertex.throughput[c] > 0.f)
+					vertex.radiance[c] += contribution[c] / vertex.throughput[c];
+	if (!cache_vertices)
+		return;
+
+	for (CacheVertex& vertex : *cache_vertices)
+		for (int c = 0; c < 3; c++)
+			if (vertex.throughput[c] > 0.f)
+				vertex.radiance[c] += contribution[c] / vertex.throughput[c];
+}
+
 Scene::~Scene()
 {
 	delete bvh;
 	bvh = nullptr;
+	for (auto* primitive : light_primitives)
+		delete primitive;
 	for (auto* light : lights)
 		delete light;
 	for (auto* primitive : primitives)
 		delete primitive;
+	for (auto& [filepath, model] : models)
+		delete model;
 }
 
 void Scene::add(Primitive* primitive)
@@ -20,6 +84,16 @@ void Scene::add(Light* light)
 	lights.push_back(light);
 }
 
+Model* Scene::load(const std::string& filepath)
+{
+	// every instance of the same file shares one set of triangles and one BVH
+	auto [it, inserted] = models.try_emplace(filepath, nullptr);
+	if (inserted)
+		it->second = new Model(filepath, nullptr, max_primitives_per_leaf, bvh_layout);
+
+	return it->second;
+}
+
 const std::vector<Light*>& Scene::getLights() const
 {
 	return lights;
@@ -32,92 +106,254 @@ const std::vector<Primitive*>& Scene::getPrimitives() const
 
 void Scene::buildBVH()
 {
-	bvh = new BVHAccel(primitives, 1, BVHBuildMethod::NAIVE);
+	// area lights are hit as the two triangles of their rectangle, made here so they follow the lights as they are now
+	for (auto* primitive : light_primitives)
+		delete primitive;
+	light_primitives.clear();
+
+	std::unordered_map<const Material*, AreaLight*> area_lights;
+	for (auto* light : lights) {
+		auto* area_light = dynamic_cast<AreaLight*>(light);
+		if (!area_light)
+			continue;
+
+		vec3f_t corner = area_light->position;
+		vec3f_t opposite = corner + area_light->u + area_light->v;
+		area_light->material.emission = area_light->intensity;
+		light_primitives.push_back(rectangleHalf(*area_light, corner, corner + area_light->u, opposite));
+		light_primitives.push_back(rectangleHalf(*area_light, corner, opposite, corner + area_light->v));
+		area_lights.emplace(&area_light->material, area_light);
+	}
+
+	std::vector<Primitive*> scene_primitives(primitives);
+	scene_primitives.insert(scene_primitives.end(), light_primitives.begin(), light_primitives.end());
+	delete bvh;
+	bvh = new BVHAccel(scene_primitives, max_primitives_per_leaf, build_method, 0, bvh_layout);
+
+	std::vector<Emitter> collected;
+	for (uint32_t i = 0; i < bvh->ordered_primitives.size(); i++)
+		bvh->ordered_primitives[i]->collectEmitters(collected, i);
+
+	// an area light is sampled as one rectangle, a hit on either of its triangles finds it
+	std::unordered_map<const AreaLight*, uint32_t> rectangles;
+	emitters.clear();
+	emitter_lookup.clear();
+	for (const Emitter& emitter : collected) {
+		uint64_t key = emitterKey(emitter.instance_id, emitter.prim_id);
+		auto     area_light = area_lights.find(emitter.material);
+		if (area_light == area_lights.end()) {
+			emitter_lookup.emplace(key, static_cast<uint32_t>(emitters.size()));
+			emitters.push_back(emitter);
+			continue;
+		}
+
+		auto [it, inserted] = rectangles.try_emplace(area_light->second, static_cast<uint32_t>(emitters.size()));
+		if (inserted)
+			emitters.emplace_back(area_light->second);
+		emitter_lookup.emplace(key, it->second);
+	}
+
+	std::vector<float> weights;
+	weights.reserve(emitters.size());
+	for (const Emitter& emitter : emitters)
+		weights.push_back(emitter.power());
+	emitter_table = AliasTable(weights);
+	light_tree = LightTree(emitters);
 }
 
 Intersection Scene::intersect(const Ray& ray) const
 {
-	return bvh->intersect(ray);
+	HitRecord hit;
+	bvh->intersect(ray, hit);
+
+	return bvh->getIntersection(ray, hit);
 }
 
-void Scene::sampleLight(Intersection& pos, float& pdf) const
+bool Scene::intersect(const Ray& ray, HitRecord& hit) const
 {
-	float emit_area_sum = 0;
-	for (const auto& p : primitives)
-		if (p->hasEmission())
-			emit_area_sum += p->area();
+	return bvh->intersect(ray, hit);
+}
 
-	float a = Geometry::randomFloat() * emit_area_sum;
-	emit_area_sum = 0;
-	for (const auto& p : primitives) {
-		if (p->hasEmission()) {
-			emit_area_sum += p->area();
-			if (a <= emit_area_sum) {
-				p->sample(pos, pdf);
-				break;
-			}
-		}
+Intersection Scene::getIntersection(const Ray& ray, const HitRecord& hit) const
+{
+	return bvh->getIntersection(ray, hit);
+}
+
+bool Scene::occluded(const Ray& ray, float tmax) const
+{
+	return bvh->occluded(ray, tmax);
+}
+
+void Scene::intersect(RayPacket& packet) const
+{
+	packet.prepare();
+	bvh->intersect(packet, packet.active);
+}
+
+void Scene::sampleLight(const vec3f_t& reference, const vec3f_t& normal, Intersection& pos, float& pdf, Sampler& sampler) const
+{
+	if (emitter_table.empty()) {
+		pdf = 0;
+		return;
 	}
+
+	// pick an emitter, then a point on it; the pdf is per unit solid angle seen from reference
+	float emitter_pmf;
+	int   index = light_selection == LightSelection::TREE ? light_tree.sample(reference, normal, sampler.get1D(), emitter_pmf)
+	                                                      : emitter_table.sample(sampler.get1D(), emitter_pmf);
+	if (index < 0) {
+		pdf = 0;
+		return;
+	}
+
+	emitters[index].sample(reference, light_sampling, pos, pdf, sampler);
+	pdf *= emitter_pmf;
 }
 
-vec3f_t Scene::castRay(const Ray& ray, int depth) const
+float Scene::lightPdf(const vec3f_t& reference, const vec3f_t& normal, const HitRecord& hit, const Intersection& light_point) const
 {
-	constexpr float EPSILON = 0.0001f;
-	static int      cnt = 0;
+	// pdf of sampleLight at reference choosing the point a ray has hit
+	auto it = emitter_lookup.find(emitterKey(hit.instance_id, hit.prim_id));
+	if (it == emitter_lookup.end())
+		return 0.f;
+
+	float emitter_pmf = light_selection == LightSelection::TREE ? light_tree.pmf(reference, normal, it->second) : emitter_table.pmf(it->second);
+	return emitter_pmf * emitters[it->second].pdf(reference, light_sampling, light_point);
+}
 
-	vec3f_t direct_lighting = vec3f_t::Zero();
-	vec3f_t indirect_lighting = vec3f_t::Zero();
+vec3f_t Scene::castRay(const Ray& ray, int depth, Sampler& sampler, std::vector<GuidingVertex>* vertices) const
+{
+	PathState path{ray};
+	path.depth = depth;
+	path.vertices = vertices;
+	while (true) {
+		HitRecord hit;
+		intersect(path.ray, hit);
+		if (!step(path, hit, sampler))
+			break;
+	}
 
-	// max depth check
-	if (depth >= max_depth)
-		return vec3f_t::Zero();
+	return path.radiance;
+}
+
+bool Scene::step(PathState& path, const HitRecord& hit, Sampler& sampler) const
+{
+	// hit check, the surface is only worked out for the closest hit
+	if (!hit.hit())
+		return false;
 
-	// hit check
-	Intersection hit_point = intersect(ray);
-	if (!hit_point.hit)
-		return vec3f_t::Zero();
+	Intersection hit_point = getIntersection(path.ray, hit);
+	ShadowRay    shadow{};
+	if (!shade(path, hit, hit_point, shadow, sampler))
+		return false;
+
+	// shadow ray, only whether something lies in front of the light matters
+	if (shadow.distance > 0.f && !occluded(shadow.ray, shadow.distance))
+		path.add(shadow.contribution);
+
+	return scatter(path, hit_point, hit_point.normal.normalized(), sampler);
+}
+
+bool Scene::shade(PathState& path, const HitRecord& hit, const Intersection& hit_point, ShadowRay& shadow, Sampler& sampler) const
+{
+	constexpr float EPSILON = 0.0001f;
+	constexpr float MAX_SPECULAR = 0.1f;        // share of glossy reflection a surface may have and still be cached
 
-	// material check
 	if (!hit_point.material)
-		return vec3f_t::Zero();
+		return false;
+
+	// emission check, an emitter reached by a bounce shares its contribution with the direct lighting of the previous vertex;
+	// like the light samples it only lights the side its normal faces
+	if (hit_point.material->hasEmission()) {
+		if (path.ray.direction.dot(hit_point.normal) < 0.f) {
+			float weight = path.count_emission ? 1.f : powerHeuristic(path.bsdf_pdf, lightPdf(path.ray.origin, path.origin_normal, hit, hit_point));
+			path.add(path.throughput.cwiseProduct(hit_point.material->emission) * weight);
+		}
+		return false;
+	}
+
+	// max depth check, after the emission so the last bounce keeps the part of the light its weight gave it
+	if (path.depth >= max_depth)
+		return false;
 
-	// emission check
-	if (hit_point.material->hasEmission())
-		return hit_point.material->emission;
+	const Ray& ray = path.ray;
+	vec3f_t    surface_normal = hit_point.normal.normalized();
 
-	// direct lighting
+	// what leaves a diffuse surface hardly depends on where it is seen from, so filling paths keep it and a path a few
+	// bounces in ends on it once its cell has seen enough
+	if (!cache.empty() && hit_point.material->specularProbability() <= MAX_SPECULAR) {
+		vec3f_t cached;
+		if (path.cache_vertices)
+			path.cache_vertices->push_back(CacheVertex{hit_point.position, surface_normal, path.throughput});
+		else if (path.depth >= cache_depth && cache.lookup(hit_point.position, surface_normal, cached)) {
+			path.add(path.throughput.cwiseProduct(cached));
+			return false;
+		}
+	}
+
+	// direct lighting, the light pdf is per unit solid angle seen from the hit
+	vec3f_t      hit_position = hit_point.position;
 	Intersection light_sample{};
 	float        light_pdf{};
-	sampleLight(light_sample, light_pdf);
+	sampleLight(hit_position, surface_normal, light_sample, light_pdf, sampler);
 
-	vec3f_t hit_position = hit_point.position;
 	vec3f_t light_position = light_sample.position;
 	vec3f_t light_direction = (light_position - hit_position).normalized();
 	float   light_distance = (light_position - hit_position).norm();
-	vec3f_t surface_normal = hit_point.normal.normalized();
 	vec3f_t light_normal = light_sample.normal.normalized();
-	vec3f_t light_emission = light_sample.emit;
+	float   cos_surface = light_direction.dot(surface_normal);
+	float   cos_light = (-light_direction).dot(light_normal);
 
-	Ray          direct_ray(hit_position, light_direction);
-	Intersection direct_hit = intersect(direct_ray);
-	if (direct_hit.distance - light_distance > -EPSILON) {
-		vec3f_t direct_brdf = hit_point.material->eval(ray.direction, direct_ray.direction, surface_normal);
-		direct_lighting = light_emission.cwiseProduct(direct_brdf) * direct_ray.direction.dot(surface_normal) * (-direct_ray.direction).dot(light_normal) / (std::pow(light_distance, 2)) / light_pdf;
+	// what the light adds is settled here, the caller only tests the shadow ray
+	if (light_pdf > 0.f && cos_surface > 0.f && cos_light > 0.f) {
+		vec3f_t direct_brdf = hit_point.material->eval(ray.direction, light_direction, surface_normal);
+		float   weight = powerHeuristic(light_pdf, scatterPdf(guide.find(hit_position), bsdf_sampling_fraction, *hit_point.material, ray.direction, light_direction, surface_normal));
+		shadow.ray = Ray(hit_position, light_direction);
+		shadow.distance = light_distance - EPSILON;
+		shadow.contribution = path.throughput.cwiseProduct(light_sample.emit.cwiseProduct(direct_brdf)) * cos_surface * weight / light_pdf;
 	}
 
-	if (Geometry::randomFloat() > russian_roulette)
-		return direct_lighting;
+	return true;
+}
+
+bool Scene::scatter(PathState& path, const Intersection& hit_point, const vec3f_t& surface_normal, Sampler& sampler) const
+{
+	constexpr float MAX_SURVIVAL = 0.95f;
+
+	// indirect lighting, the path continues along a sampled direction; once a guide is trained it picks some of them
+	const Ray&   ray = path.ray;
+	const DTree* guide_tree = guide.find(hit_point.position);
+	vec3f_t      indirect_direction;
+	if (guide_tree && sampler.get1D() >= bsdf_sampling_fraction)
+		indirect_direction = guide_tree->sample(sampler.get2D());
+	else
+		indirect_direction = hit_point.material->sample(ray.direction, surface_normal, sampler).normalized();
+
+	float pdf = scatterPdf(guide_tree, bsdf_sampling_fraction, *hit_point.material, ray.direction, indirect_direction, surface_normal);
+	float cos_indirect = indirect_direction.dot(surface_normal);
+	if (pdf <= 0.f || cos_indirect <= 0.f)
+		return false;
 
-	vec3f_t      indirect_direction = hit_point.material->sample(ray.direction, surface_normal).normalized();
-	Ray          indirect_ray(hit_point.position, indirect_direction);
-	Intersection indirect_hit = intersect(indirect_ray);
-	if (indirect_hit.hit && (!indirect_hit.material->hasEmission())) {
-		vec3f_t indirect_brdf = hit_point.material->eval(ray.direction, indirect_direction, surface_normal);
-		float   pdf = hit_point.material->pdf(ray.direction, indirect_ray.direction, surface_normal);
-		indirect_lighting = castRay(indirect_ray, depth + 1).cwiseProduct(indirect_brdf) * indirect_ray.direction.dot(surface_normal) / pdf / russian_roulette;
+	vec3f_t indirect_brdf = hit_point.material->eval(ray.direction, indirect_direction, surface_normal);
+	path.throughput = path.throughput.cwiseProduct(indirect_brdf) * cos_indirect / pdf;
+	path.ray = Ray(hit_point.position, indirect_direction);
+	path.count_emission = false;
+	path.bsdf_pdf = pdf;
+	path.origin_normal = surface_normal;
+	path.depth++;
+
+	// russian roulette, paths that can only add little are ended early and the survivors weighted up
+	if (path.depth >= russian_roulette_depth) {
+		float survival = std::min(path.throughput.maxCoeff(), MAX_SURVIVAL);
+		if (sampler.get1D() >= survival)
+			return false;
+		path.throughput /= survival;
 	}
 
-	return direct_lighting + indirect_lighting;
+	if (path.vertices)
+		path.vertices->push_back(GuidingVertex{hit_point.position, indirect_direction, path.throughput, vec3f_t::Zero(), pdf});
+
+	return true;
 }
 
 bool Scene::trace(const Ray& ray, const std::vector<Primitive*>& primitives, float& tnear, uint32_t& index, Primitive** hit_object)
@@ -1,31 +1,92 @@
 #pragma once
 
+#include <string>
+#include <unordered_map>
+
 #include "Light.hpp"
 #include "BVH.hpp"
+#include "Instance.hpp"
+#include "AliasTable.hpp"
+#include "LightTree.hpp"
+#include "SDTree.hpp"
+#include "RadianceCache.hpp"
+
+// one path in flight; Scene::step advances it a vertex at a time, so single rays and batches share the integrator
+struct PathState {
+	Ray     ray;
+	vec3f_t throughput{1, 1, 1};
+	vec3f_t radiance{0, 0, 0};
+	int     depth{};
+	bool    count_emission{true};        // camera rays see emitters in full, bounces weight them against light sampling
+	float   bsdf_pdf{};                  // solid angle pdf the current ray direction was sampled with
+	vec3f_t origin_normal{0, 0, 0};      // surface normal where the current ray started
+
+	std::vector<GuidingVertex>* vertices{};              // set while training path guiding, scatter events are kept here
+	std::vector<CacheVertex>*   cache_vertices{};        // set while filling the radiance cache, surfaces reached are kept here
+
+	void add(const vec3f_t& contribution);
+};
+
+// light sample of a path vertex waiting on its occlusion test, added to the path's radiance when nothing blocks it
+struct ShadowRay {
+	Ray     ray{vec3f_t(0, 0, 0), vec3f_t(0, 0, 0), 0};
+	float   distance{};        // 0 when there is nothing to test
+	vec3f_t contribution{0, 0, 0};
+};
 
 struct Scene {
-	BVHAccel* bvh;
+	BVHAccel* bvh{};
 
 	int width{48};
 	int height{64};
 
-	int   max_depth{3};
-	float russian_roulette{0.8f};
+	int max_depth{16};
+	int russian_roulette_depth{3};        // bounces before paths may be terminated by their throughput
+	int cache_depth{1};                   // bounces before paths may end at the radiance cache
+
+	int            max_primitives_per_leaf{4};
+	BVHBuildMethod build_method{BVHBuildMethod::SAH};
+	BVHLayout      bvh_layout{BVHLayout::BINARY};
+	LightSampling  light_sampling{LightSampling::AREA};
+	LightSelection light_selection{LightSelection::POWER};
 
 	std::vector<Light*>     lights;
 	std::vector<Primitive*> primitives;
+	std::vector<Primitive*> light_primitives;        // triangles of the area lights, made by buildBVH
+
+	std::unordered_map<std::string, Model*> models;
+
+	std::vector<Emitter> emitters;             // every emissive triangle and area light in world space, gathered by buildBVH
+	AliasTable           emitter_table;        // picks an emitter by area times power
+	LightTree            light_tree;           // or by what it is likely to add at a point
+
+	std::unordered_map<uint64_t, uint32_t> emitter_lookup;        // emitter of a hit, by instance and primitive id
+
+	SDTree guide;                              // where light arrives from, empty unless trained
+	float  bsdf_sampling_fraction{.5f};        // of the bounces a trained guide leaves to the bsdf
+
+	RadianceCache cache;        // what leaves diffuse surfaces, empty unless filled
 
 	~Scene();
 
 	void add(Primitive* primitive);
 	void add(Light* light);
+	auto load(const std::string& filepath) -> Model*;
 
 	auto getLights() const -> const std::vector<Light*>&;
 	auto getPrimitives() const -> const std::vector<Primitive*>&;
 
 	void buildBVH();
 	auto intersect(const Ray& ray) const -> Intersection;
-	void sampleLight(Intersection& pos, float& pdf) const;
-	auto castRay(const Ray& ray, int depth) const -> vec3f_t;
+	bool intersect(const Ray& ray, HitRecord& hit) const;
+	auto getIntersection(const Ray& ray, const HitRecord& hit) const -> Intersection;
+	void intersect(RayPacket& packet) const;
+	bool occluded(const Ray& ray, float tmax) const;
+	void sampleLight(const vec3f_t& reference, const vec3f_t& normal, Intersection& pos, float& pdf, Sampler& sampler) const;
+	auto lightPdf(const vec3f_t& reference, const vec3f_t& normal, const HitRecord& hit, const Intersection& light_point) const -> float;
+	auto castRay(const Ray& ray, int depth, Sampler& sampler, std::vector<GuidingVertex>* vertices = nullptr) const -> vec3f_t;
+	bool step(PathState& path, const HitRecord& hit, Sampler& sampler) const;
+	bool shade(PathState& path, const HitRecord& hit, const Intersection& hit_point, ShadowRay& shadow, Sampler& sampler) const;
+	bool scatter(PathState& path, const Intersection& hit_point, const vec3f_t& surface_normal, Sampler& sampler) const;
 	bool trace(const Ray& ray, const std::vector<Primitive*>& objects, float& tnear, uint32_t& index, Primitive** hit_object);
 };
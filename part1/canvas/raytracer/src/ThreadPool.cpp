@@ -0,0 +1,93 @@
+#include "ThreadPool.hpp"
+
+ThreadPool::ThreadPool(int num_threads)
+{
+	if (num_threads <= 0)
+		num_threads = std::max(1u, std::thread::hardware_concurrency());
+
+	workers.reserve(num_threads);
+	for (int i = 0; i < num_threads; i++)
+		workers.emplace_back(&ThreadPool::work, this);
+}
+
+ThreadPool::~ThreadPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	task_available.notify_all();
+
+	for (auto& worker : workers)
+		worker.join();
+}
+
+int ThreadPool::size() const
+{
+	return workers.size();
+}
+
+void ThreadPool::submit(std::function<void()> task)
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		tasks.push(std::move(task));
+		pending++;
+	}
+	task_available.notify_one();
+}
+
+void ThreadPool::wait()
+{
+	// the waiting thread runs queued tasks too instead of sleeping next to the workers
+	std::unique_lock<std::mutex> lock(mutex);
+	while (pending > 0) {
+		if (tasks.empty()) {
+			all_done.wait(lock);
+			continue;
+		}
+
+		auto task = std::move(tasks.front());
+		tasks.pop();
+		lock.unlock();
+		task();
+		lock.lock();
+		finish();
+	}
+}
+
+void ThreadPool::parallelFor(int begin, int end, const std::function<void(int, int, int)>& func)
+{
+	// one chunk per worker, called as func(chunk, chunk_begin, chunk_end); not to be used from inside a task
+	int num_chunks = size();
+	int chunk_size = (end - begin + num_chunks - 1) / num_chunks;
+	for (int chunk = 0; chunk < num_chunks; chunk++) {
+		int chunk_begin = std::min(end, begin + chunk * chunk_size);
+		int chunk_end = std::min(end, chunk_begin + chunk_size);
+		submit([&func, chunk, chunk_begin, chunk_end] { func(chunk, chunk_begin, chunk_end); });
+	}
+	wait();
+}
+
+void ThreadPool::work()
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	while (true) {
+		task_available.wait(lock, [this] { return stopping || !tasks.empty(); });
+		if (tasks.empty())
+			return;
+
+		auto task = std::move(tasks.front());
+		tasks.pop();
+		lock.unlock();
+		task();
+		lock.lock();
+		finish();
+	}
+}
+
+void ThreadPool::finish()
+{
+	if (--pending == 0)
+		all_done.notify_all();
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <queue>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <functional>
+#include <condition_variable>
+
+class ThreadPool {
+public:
+	explicit ThreadPool(int num_threads = 0);
+	~ThreadPool();
+
+	int  size() const;
+	void submit(std::function<void()> task);
+	void wait();
+	void parallelFor(int begin, int end, const std::function<void(int, int, int)>& func);
+
+private:
+	std::vector<std::thread>          workers;
+	std::queue<std::function<void()>> tasks;
+	std::mutex                        mutex;
+	std::condition_variable           task_available;
+	std::condition_variable           all_done;
+
+	int  pending{0};
+	bool stopping{false};
+
+	void work();
+	void finish();
+};
@@ -0,0 +1,276 @@
+#include "Wavefront.hpp"
+
+#include <iostream>
+
+#include "Raytracer.hpp"
+
+namespace
+{
+uint32_t spread3(uint32_t v)
+{
+	v &= 0xf;
+	v = (v | (v << 4)) & 0x0c3u;
+	v = (v | (v << 2)) & 0x249u;
+	return v;
+}
+
+// direction octant above a coarse morton code of the origin, so neighbouring keys start close together and head the same way
+uint32_t binKey(const Ray& ray, const Bound& bound)
+{
+	constexpr float CELLS = 15.f;
+
+	vec3f_t  offset = bound.offset(ray.origin).cwiseMax(0.f).cwiseMin(1.f) * CELLS;
+	uint32_t octant = (ray.direction.x() < 0.f) | (ray.direction.y() < 0.f) << 1 | (ray.direction.z() < 0.f) << 2;
+	uint32_t morton = spread3(static_cast<uint32_t>(offset.x())) | spread3(static_cast<uint32_t>(offset.y())) << 1 |
+	                  spread3(static_cast<uint32_t>(offset.z())) << 2;
+
+	return octant << 12 | morton;
+}
+
+// slots ordered by key in one counting pass, stable so equal keys keep slot order
+void sortByKey(const std::vector<uint32_t>& keys, int count, std::vector<int>& offsets, std::vector<int>& order)
+{
+	std::fill(offsets.begin(), offsets.end(), 0);
+	for (int slot = 0; slot < count; slot++)
+		offsets[keys[slot] + 1]++;
+	for (size_t key = 1; key < offsets.size(); key++)
+		offsets[key] += offsets[key - 1];
+	for (int slot = 0; slot < count; slot++)
+		order[offsets[keys[slot]]++] = slot;
+}
+};        // namespace
+
+void PathQueue::resize(int size)
+{
+	rays.resize(size);
+	hits.resize(size);
+	surfaces.resize(size);
+	shadows.resize(size);
+	throughputs.resize(size);
+	radiance.resize(size);
+	origin_normals.resize(size);
+	bsdf_pdfs.resize(size);
+	depths.resize(size);
+	count_emission.resize(size);
+	alive.resize(size);
+	pixels.resize(size);
+	samplers.resize(size);
+}
+
+PathState PathQueue::load(int slot) const
+{
+	PathState path{rays[slot]};
+	path.throughput = throughputs[slot];
+	path.radiance = radiance[slot];
+	path.depth = depths[slot];
+	path.count_emission = count_emission[slot];
+	path.bsdf_pdf = bsdf_pdfs[slot];
+	path.origin_normal = origin_normals[slot];
+
+	return path;
+}
+
+void PathQueue::store(int slot, const PathState& path)
+{
+	rays[slot] = path.ray;
+	throughputs[slot] = path.throughput;
+	radiance[slot] = path.radiance;
+	depths[slot] = path.depth;
+	count_emission[slot] = path.count_emission;
+	bsdf_pdfs[slot] = path.bsdf_pdf;
+	origin_normals[slot] = path.origin_normal;
+}
+
+void PathQueue::move(int from, int to)
+{
+	// only what outlives a round, hits, surfaces and shadow rays are rewritten by the next
+	store(to, load(from));
+	alive[to] = alive[from];
+	pixels[to] = pixels[from];
+	samplers[to] = samplers[from];
+}
+
+Wavefront::Wavefront(Raytracer& raytracer, int batch_size)
+    : raytracer(raytracer), scene(*raytracer.scene), pool(raytracer.num_threads), batch_size(std::max(batch_size, 1))
+{
+	queue.resize(this->batch_size);
+	keys.resize(this->batch_size);
+	order.resize(this->batch_size);
+}
+
+void Wavefront::render()
+{
+	const int     pixels = scene.width * scene.height;
+	const int64_t total = static_cast<int64_t>(pixels) * std::max(raytracer.samples_per_pixel, 1);
+
+	std::vector<vec3f_t> sum(pixels, vec3f_t::Zero());
+	std::vector<int>     counts(pixels, 0);
+
+	int64_t next = 0;
+	int64_t finished = 0;
+	int64_t reported = -1;
+	for (int count = 0; count > 0 || next < total;) {
+		// the slots finished paths left are refilled first, so every stage sees a full batch until the image runs out
+		int fill = static_cast<int>(std::min<int64_t>(batch_size - count, total - next));
+		generate(count, count + fill, next);
+		next += fill;
+		count += fill;
+
+		extend(count);
+		shade(count);
+		scatter(count);
+		connect(count);
+
+		// finished paths are added to their pixels in slot order, the rest move to the front
+		int alive = 0;
+		for (int slot = 0; slot < count; slot++) {
+			if (queue.alive[slot]) {
+				if (slot != alive)
+					queue.move(slot, alive);
+				alive++;
+				continue;
+			}
+
+			sum[queue.pixels[slot]] += queue.radiance[slot];
+			counts[queue.pixels[slot]]++;
+			finished++;
+		}
+		count = alive;
+
+		if (finished / 1000 != reported) {
+			reported = finished / 1000;
+			std::cout << "\rRendering: " << reported << "k / " << total / 1000 << "k samples" << std::flush;
+		}
+	}
+	std::cout << std::endl;
+
+	for (int p = 0; p < pixels; p++) {
+		raytracer.framebuffer[p] = sum[p] / std::max(counts[p], 1);
+		raytracer.sample_counts[p] = counts[p];
+	}
+}
+
+void Wavefront::generate(int begin, int end, int64_t first_sample)
+{
+	// samples are numbered sample-major, a batch covers whole scanlines and its camera rays start out coherent
+	const int pixels = scene.width * scene.height;
+	pool.parallelFor(begin, end, [&](int, int slot_begin, int slot_end) {
+		for (int slot = slot_begin; slot < slot_end; slot++) {
+			int64_t sample = first_sample + slot - begin;
+			int     pixel = static_cast<int>(sample % pixels);
+			int     i = pixel % scene.width;
+			int     j = pixel / scene.width;
+
+			Sampler& sampler = queue.samplers[slot];
+			sampler = Sampler(raytracer.sampler_type, raytracer.samples_per_pixel, raytracer.seed);
+			sampler.startPixel(i, j, raytracer.first_sample + static_cast<int>(sample / pixels));
+			queue.store(slot, PathState{raytracer.cameraRay(i, j, sampler)});
+			queue.pixels[slot] = pixel;
+		}
+	});
+}
+
+void Wavefront::extend(int count)
+{
+	constexpr int PACKET = RayPacket::SIZE;
+	constexpr int BINS = 8 << 12;
+
+	// binned by origin and direction, so the rays of a packet or of one thread's run share most of their traversal
+	const Bound bound = scene.bvh->bound();
+	pool.parallelFor(0, count, [&](int, int slot_begin, int slot_end) {
+		for (int slot = slot_begin; slot < slot_end; slot++)
+			keys[slot] = binKey(queue.rays[slot], bound);
+	});
+	offsets.resize(BINS + 1);
+	sortByKey(keys, count, offsets, order);
+
+	pool.parallelFor(0, (count + PACKET - 1) / PACKET, [&](int, int group_begin, int group_end) {
+		for (int group = group_begin; group < group_end; group++) {
+			int first = group * PACKET;
+			int last = std::min(first + PACKET, count);
+			if (!raytracer.packet_tracing) {
+				for (int k = first; k < last; k++) {
+					int slot = order[k];
+					queue.hits[slot] = HitRecord{};
+					scene.intersect(queue.rays[slot], queue.hits[slot]);
+				}
+				continue;
+			}
+
+			RayPacket packet;
+			for (int k = first; k < last; k++)
+				packet.set(k - first, queue.rays[order[k]]);
+			scene.intersect(packet);
+			for (int k = first; k < last; k++)
+				queue.hits[order[k]] = packet.hits[k - first];
+		}
+	});
+}
+
+void Wavefront::shade(int count)
+{
+	constexpr int BINS = 256;        // materials are hashed into bins, two sharing one only share a run
+
+	pool.parallelFor(0, count, [&](int, int slot_begin, int slot_end) {
+		for (int slot = slot_begin; slot < slot_end; slot++) {
+			const HitRecord& hit = queue.hits[slot];
+			Intersection&    surface = queue.surfaces[slot];
+			surface = hit.hit() ? scene.getIntersection(queue.rays[slot], hit) : Intersection{};
+			keys[slot] = static_cast<uint32_t>(reinterpret_cast<uintptr_t>(surface.material) >> 4) % BINS;
+		}
+	});
+
+	// grouped by material, a thread evaluates one material's parameters and textures over a run of hits
+	offsets.resize(BINS + 1);
+	sortByKey(keys, count, offsets, order);
+
+	pool.parallelFor(0, count, [&](int, int begin, int end) {
+		for (int k = begin; k < end; k++) {
+			int       slot = order[k];
+			PathState path = queue.load(slot);
+			queue.shadows[slot] = ShadowRay{};
+			queue.alive[slot] = scene.shade(path, queue.hits[slot], queue.surfaces[slot], queue.shadows[slot], queue.samplers[slot]);
+			queue.store(slot, path);
+		}
+	});
+}
+
+void Wavefront::scatter(int count)
+{
+	// in the material order shade left, each path draws its bounce after its light sample as in the tiled renderer
+	pool.parallelFor(0, count, [&](int, int begin, int end) {
+		for (int k = begin; k < end; k++) {
+			int slot = order[k];
+			if (!queue.alive[slot])
+				continue;
+
+			PathState           path = queue.load(slot);
+			const Intersection& surface = queue.surfaces[slot];
+			queue.alive[slot] = scene.scatter(path, surface, surface.normal.normalized(), queue.samplers[slot]);
+			queue.store(slot, path);
+		}
+	});
+}
+
+void Wavefront::connect(int count)
+{
+	constexpr int BINS = 8 << 12;
+
+	// shadow rays are binned like the rays they branch off, most of a run heads for the same light
+	const Bound bound = scene.bvh->bound();
+	pool.parallelFor(0, count, [&](int, int slot_begin, int slot_end) {
+		for (int slot = slot_begin; slot < slot_end; slot++)
+			keys[slot] = queue.shadows[slot].distance > 0.f ? binKey(queue.shadows[slot].ray, bound) : 0;
+	});
+	offsets.resize(BINS + 1);
+	sortByKey(keys, count, offsets, order);
+
+	pool.parallelFor(0, count, [&](int, int begin, int end) {
+		for (int k = begin; k < end; k++) {
+			int              slot = order[k];
+			const ShadowRay& shadow = queue.shadows[slot];
+			if (shadow.distance > 0.f && !scene.occluded(shadow.ray, shadow.distance))
+				queue.radiance[slot] += shadow.contribution;
+		}
+	});
+}
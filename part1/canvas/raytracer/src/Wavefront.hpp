@@ -0,0 +1,56 @@
+#pragma once
+
+#include "Scene.hpp"
+#include "ThreadPool.hpp"
+
+class Raytracer;
+
+// paths in flight, one array per field so a stage streams through only what it reads
+struct PathQueue {
+	std::vector<Ray>          rays;
+	std::vector<HitRecord>    hits;
+	std::vector<Intersection> surfaces;
+	std::vector<ShadowRay>    shadows;
+	std::vector<vec3f_t>      throughputs;
+	std::vector<vec3f_t>      radiance;
+	std::vector<vec3f_t>      origin_normals;
+	std::vector<float>        bsdf_pdfs;
+	std::vector<int>          depths;
+	std::vector<uint8_t>      count_emission;
+	std::vector<uint8_t>      alive;
+	std::vector<int>          pixels;
+	std::vector<Sampler>      samplers;
+
+	void resize(int size);
+	auto load(int slot) const -> PathState;
+	void store(int slot, const PathState& path);
+	void move(int from, int to);
+};
+
+// renders a whole image as large batches of paths, every path of a batch going through one stage before any starts the next:
+// generate camera rays, extend them to their closest hits, shade the hits grouped by material, scatter the survivors into
+// their next rays, connect the shadow rays, then accumulate finished paths and compact the queue; paths take the same
+// samples as in the tiled renderer
+class Wavefront {
+public:
+	Wavefront(Raytracer& raytracer, int batch_size);
+
+	void render();
+
+private:
+	Raytracer&   raytracer;
+	const Scene& scene;
+	ThreadPool   pool;
+	PathQueue    queue;
+	int          batch_size;
+
+	std::vector<uint32_t> keys;           // per slot, the bin a stage sorts it into
+	std::vector<int>      offsets;        // per bin
+	std::vector<int>      order;          // slots by bin
+
+	void generate(int begin, int end, int64_t first_sample);
+	void extend(int count);
+	void shade(int count);
+	void scatter(int count);
+	void connect(int count);
+};
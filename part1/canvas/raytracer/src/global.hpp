@@ -1,8 +1,16 @@
 #pragma once
 
-#include <random>
+#include <algorithm>
 #include <eigen3/Eigen/Eigen>
 
+#if defined(__AVX__)
+#	include <immintrin.h>
+#	define SIMD_AVX
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#	include <emmintrin.h>
+#	define SIMD_SSE
+#endif
+
 constexpr float PI = 3.14159265358979323846;
 
 using vec2f_t = Eigen::Vector2f;
@@ -98,13 +106,9 @@ inline mat4f_t ortho(float left, float right, float bottom, float top, float zNe
 	return res;
 }
 
-inline float randomFloat()
+inline float luminance(const vec3f_t& color)
 {
-	std::random_device                    dev;
-	std::mt19937                          rng(dev());
-	std::uniform_real_distribution<float> dist(0.0f, 1.0f);
-
-	return dist(rng);
+	return 0.2126f * color.x() + 0.7152f * color.y() + 0.0722f * color.z();
 }
 
 inline bool solveQuadratic(const float& a, const float& b, const float& c, float& x0, float& x1)
@@ -125,4 +129,42 @@ inline bool solveQuadratic(const float& a, const float& b, const float& c, float
 
 	return true;
 }
+
+// solid angle of the spherical triangle spanned by three unit vectors, Van Oosterom and Strackee
+inline float sphericalTriangleArea(const vec3f_t& a, const vec3f_t& b, const vec3f_t& c)
+{
+	return std::fabs(2.f * std::atan2(a.dot(b.cross(c)), 1.f + a.dot(b) + a.dot(c) + b.dot(c)));
+}
+
+// direction uniformly distributed over the spherical triangle spanned by three unit vectors, Arvo's method
+inline vec3f_t sampleSphericalTriangle(const vec3f_t& a, const vec3f_t& b, const vec3f_t& c, float solid_angle, const vec2f_t& u)
+{
+	// the angle at a from its two edge planes, the other two only enter through the solid angle
+	vec3f_t n_ab = a.cross(b).normalized();
+	vec3f_t n_ca = c.cross(a).normalized();
+	float   cos_alpha = std::clamp(-n_ab.dot(n_ca), -1.f, 1.f);
+	float   sin_alpha = std::sqrt(1.f - cos_alpha * cos_alpha);
+
+	// the first coordinate picks the sub triangle of u.x times the area, fixing a point c' on the arc from a to c
+	float sin_area = -std::sin(u.x() * solid_angle);        // of the sub triangle's angle sum, its area plus pi
+	float cos_area = -std::cos(u.x() * solid_angle);
+	float sin_phi = sin_area * cos_alpha - cos_area * sin_alpha;
+	float cos_phi = cos_area * cos_alpha + sin_area * sin_alpha;
+	float k1 = cos_phi + cos_alpha;
+	float k2 = sin_phi - sin_alpha * a.dot(b);
+	float cos_b = (k2 + (k2 * cos_phi - k1 * sin_phi) * cos_alpha) / ((k2 * sin_phi + k1 * cos_phi) * sin_alpha);
+	cos_b = std::isfinite(cos_b) ? std::clamp(cos_b, -1.f, 1.f) : 1.f;
+	float   sin_b = std::sqrt(1.f - cos_b * cos_b);
+	vec3f_t c_prime = cos_b * a + sin_b * (c - c.dot(a) * a).normalized();
+
+	// the second coordinate picks a point on the arc from b to c'
+	vec3f_t arc = c_prime - c_prime.dot(b) * b;
+	if (arc.squaredNorm() < 1e-12f)
+		return b;
+
+	float cos_theta = 1.f - u.y() * (1.f - c_prime.dot(b));
+	float sin_theta = std::sqrt(std::max(0.f, 1.f - cos_theta * cos_theta));
+
+	return (cos_theta * b + sin_theta * arc.normalized()).normalized();
+}
 };        // namespace Geometry
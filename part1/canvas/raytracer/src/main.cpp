@@ -1,21 +1,55 @@
+#include <algorithm>
 #include <chrono>
 #include <iostream>
+#include <thread>
 
 #include "Raytracer.hpp"
 #include "Model.hpp"
+#include "Accumulator.hpp"
 
 void init(Scene& scene);
+int  merge(const std::string& output, const std::vector<std::string>& inputs);
+int  buildScaling(const std::string& filepath, int max_threads);
 
+// raytracer [checkpoint [seed]] renders into, or resumes, a checkpoint; raytracer --merge output input... adds partial
+// renders with different seeds up; raytracer --build-scaling model.obj [threads] times the BVH build on 1 to threads
 int main(int argc, const char* argv[])
 {
+	if (argc > 1 && std::string(argv[1]) == "--build-scaling") {
+		if (argc < 3) {
+			std::cerr << "Usage: " << argv[0] << " --build-scaling model.obj [threads]" << std::endl;
+			return 1;
+		}
+		int max_threads = argc > 3 ? std::stoi(argv[3]) : std::max<int>(std::thread::hardware_concurrency(), 1);
+		return buildScaling(argv[2], max_threads);
+	}
+
+	if (argc > 1 && std::string(argv[1]) == "--merge") {
+		if (argc < 4) {
+			std::cerr << "Usage: " << argv[0] << " --merge output input..." << std::endl;
+			return 1;
+		}
+		return merge(argv[2], std::vector<std::string>(argv + 3, argv + argc));
+	}
+
 	Scene scene;
 	init(scene);
 
 	auto start = std::chrono::system_clock::now();
 
 	Raytracer raytracer;
+	if (argc > 1)
+		raytracer.checkpoint_path = argv[1];
+	if (argc > 2)
+		raytracer.seed = static_cast<uint32_t>(std::stoul(argv[2]));
 	raytracer.render(scene);
 	raytracer.save(BUILD_PATH_2 "/cornellbox.ppm");
+	raytracer.savePFM(BUILD_PATH_2 "/cornellbox.pfm");
+	if (raytracer.adaptive_sampling)
+		raytracer.saveHeatmap(BUILD_PATH_2 "/heatmap.ppm");
+	if (raytracer.radiance_cache)
+		std::cout << "Radiance cache: " << scene.cache.cells() << " cells, " << scene.cache.hitRate() * 100.f << "% of lookups hit"
+		          << std::endl;
 
 	auto stop = std::chrono::system_clock::now();
 
@@ -25,6 +59,86 @@ int main(int argc, const char* argv[])
 	return 0;
 }
 
+int merge(const std::string& output, const std::vector<std::string>& inputs)
+{
+	// no seed may be in two inputs, checked before the output is touched; Accumulator::merge refuses the output's own too
+	std::vector<uint32_t> seeds;
+	for (const auto& input : inputs) {
+		for (uint32_t seed : Accumulator(input).seeds()) {
+			if (std::find(seeds.begin(), seeds.end(), seed) != seeds.end())
+				throw std::runtime_error("Checkpoint has the same seed: " + input);
+			seeds.push_back(seed);
+		}
+	}
+
+	// the output is created at the inputs' resolution, or added to if it exists already
+	Accumulator first(inputs[0]);
+	Accumulator merged(output, first.width(), first.height(), first.seed());
+	for (const auto& input : inputs)
+		merged.merge(Accumulator(input));
+	merged.checkpoint();
+
+	Scene scene;
+	scene.width = merged.width();
+	scene.height = merged.height();
+
+	Raytracer raytracer;
+	raytracer.scene = &scene;
+	merged.resolve(raytracer.framebuffer, raytracer.sample_counts);
+	raytracer.save(BUILD_PATH_2 "/merged.ppm");
+	raytracer.savePFM(BUILD_PATH_2 "/merged.pfm");
+
+	return 0;
+}
+
+namespace
+{
+bool sameTree(const BVHAccel& a, const BVHAccel& b)
+{
+	if (a.nodes.size() != b.nodes.size() || a.ordered_primitives != b.ordered_primitives)
+		return false;
+
+	for (size_t i = 0; i < a.nodes.size(); i++) {
+		const LinearBVHNode& x = a.nodes[i];
+		const LinearBVHNode& y = b.nodes[i];
+		if (x.bound.pmin != y.bound.pmin || x.bound.pmax != y.bound.pmax || x.primitives_offset != y.primitives_offset ||
+		    x.num_primitives != y.num_primitives || x.split_axis != y.split_axis)
+			return false;
+	}
+
+	return true;
+}
+};        // namespace
+
+int buildScaling(const std::string& filepath, int max_threads)
+{
+	// the model's triangles built again on every thread count, each tree checked against the serial builder's
+	Model                   model(filepath);
+	std::vector<Primitive*> primitives;
+	primitives.reserve(model.triangles.size());
+	for (auto& triangle : model.triangles)
+		primitives.push_back(&triangle);
+	std::cout << primitives.size() << " triangles" << std::endl;
+
+	auto     start = std::chrono::steady_clock::now();
+	BVHAccel serial(primitives, 4, BVHBuildMethod::SAH, 1);
+	auto     serial_time = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start);
+	std::cout << "1 thread: " << serial_time.count() << " ms" << std::endl;
+
+	for (int threads = 2; threads <= max_threads; threads++) {
+		start = std::chrono::steady_clock::now();
+		BVHAccel bvh(primitives, 4, BVHBuildMethod::SAH, threads);
+		auto     time = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start);
+		std::cout << threads << " threads: " << time.count() << " ms, " << serial_time / time << "x" << std::endl;
+		if (!sameTree(serial, bvh)) {
+			std::cerr << "The tree built on " << threads << " threads differs from the serial one" << std::endl;
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
 void init(Scene& scene)
 {
 	Material* red = new Material();
@@ -40,19 +154,19 @@ void init(Scene& scene)
 	light->emission = vec3f_t(47.8348f, 38.5664f, 31.0808f);
 	light->kd = vec3f_t(0.65f, 0.65f, 0.65f);
 
-	auto* floor_mesh = new Model(PROJECT_PATH_2 "/assets/cornell/floor.obj", white);
-	auto* shortbox_mesh = new Model(PROJECT_PATH_2 "/assets/cornell/shortbox.obj", white);
-	auto* tallbox_mesh = new Model(PROJECT_PATH_2 "/assets/cornell/tallbox.obj", white);
-	auto* left_mesh = new Model(PROJECT_PATH_2 "/assets/cornell/left.obj", red);
-	auto* right_mesh = new Model(PROJECT_PATH_2 "/assets/cornell/right.obj", green);
-	auto* light_mesh = new Model(PROJECT_PATH_2 "/assets/cornell/light.obj", light);
-
-	scene.add(floor_mesh);
-	scene.add(shortbox_mesh);
-	scene.add(tallbox_mesh);
-	scene.add(left_mesh);
-	scene.add(right_mesh);
-	scene.add(light_mesh);
+	auto* floor_mesh = scene.load(PROJECT_PATH_2 "/assets/cornell/floor.obj");
+	auto* shortbox_mesh = scene.load(PROJECT_PATH_2 "/assets/cornell/shortbox.obj");
+	auto* tallbox_mesh = scene.load(PROJECT_PATH_2 "/assets/cornell/tallbox.obj");
+	auto* left_mesh = scene.load(PROJECT_PATH_2 "/assets/cornell/left.obj");
+	auto* right_mesh = scene.load(PROJECT_PATH_2 "/assets/cornell/right.obj");
+	auto* light_mesh = scene.load(PROJECT_PATH_2 "/assets/cornell/light.obj");
+
+	scene.add(new Instance(floor_mesh, mat4f_t::Identity(), white));
+	scene.add(new Instance(shortbox_mesh, mat4f_t::Identity(), white));
+	scene.add(new Instance(tallbox_mesh, mat4f_t::Identity(), white));
+	scene.add(new Instance(left_mesh, mat4f_t::Identity(), red));
+	scene.add(new Instance(right_mesh, mat4f_t::Identity(), green));
+	scene.add(new Instance(light_mesh, mat4f_t::Identity(), light));
 
 	scene.buildBVH();
 }